@@ -8,26 +8,87 @@
 
 using namespace rose;
 
+#include <cstdint>
 #include <functional>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 // 16:16 fixed point
 typedef int number_t;
 #define MAKE_NUMBER(n) (int((n) * 65536))
 #define NUMBER_TO_INT(n) ((short)((n) >> 16))
 
+// Side table of node attributes. Nodes get dense ids in the order they are
+// added, and their values are stored contiguously by id. The ids are found
+// through an open addressing table of node pointers.
 template <class T>
 class nodemap {
-	std::unordered_map<void*,T> inner_map;
+	struct Slot {
+		void* key;
+		int id;
+	};
+	struct Entry {
+		T value;
+	};
+
+	std::vector<Slot> slots;
+	std::vector<Entry> entries;
+	int null_id = -1;
+	int shift = 64;
+
+	template <class N>
+	static void* key_of(N& n) {
+		return *(void**)(void*)&n;
+	}
+
+	size_t find(void* key) const {
+		size_t mask = slots.size() - 1;
+		size_t i = (size_t)(((uint64_t)(uintptr_t)key * 0x9E3779B97F4A7C15ULL) >> shift);
+		while (slots[i].key != nullptr && slots[i].key != key) {
+			i = (i + 1) & mask;
+		}
+		return i;
+	}
+
+	void grow() {
+		std::vector<Slot> old = std::move(slots);
+		slots.assign(old.empty() ? 16 : old.size() * 2, Slot{nullptr, -1});
+		shift = 64 - __builtin_ctzll(slots.size());
+		for (const Slot& slot : old) {
+			if (slot.key != nullptr) slots[find(slot.key)] = slot;
+		}
+	}
+
 public:
 	template <class N>
 	T& operator[](N n) {
-		void* key = *(void**)(void*)&n;
-		return inner_map[key];
+		void* key = key_of(n);
+		if (key == nullptr) {
+			if (null_id < 0) {
+				null_id = entries.size();
+				entries.emplace_back();
+			}
+			return entries[null_id].value;
+		}
+		if ((entries.size() + 1) * 2 > slots.size()) grow();
+		Slot& slot = slots[find(key)];
+		if (slot.key == nullptr) {
+			slot.key = key;
+			slot.id = entries.size();
+			entries.emplace_back();
+		}
+		return entries[slot.id].value;
+	}
+
+	template <class N>
+	size_t count(N n) {
+		void* key = key_of(n);
+		if (key == nullptr) return null_id >= 0;
+		return !slots.empty() && slots[find(key)].key != nullptr;
 	}
 
-	size_t size() { return inner_map.size(); }
+	size_t size() { return entries.size(); }
 };
 
 class Reporter;
@@ -96,6 +157,8 @@ class Reporter {
 	nodemap<std::string>& part_path;
 	std::unordered_set<int> defied_lines;
 	nodemap<std::unordered_set<std::string>> warning_nodes;
+	bool quiet = false;
+	int warning_count = 0;
 
 	const char* filename(Token token) {
 		Node node = token;
@@ -129,12 +192,28 @@ public:
 
 	void reportWarning(Token token, std::string message) {
 		if (!defied_lines.count(token.getLine()) && !warning_nodes[token].count(message)) {
-			printf("%s:%d:%d: Warning: %s\n", filename(token), token.getLine(), token.getPos(), message.c_str());
-			fflush(stdout);
+			warning_count++;
+			if (!quiet) {
+				printf("%s:%d:%d: Warning: %s\n", filename(token), token.getLine(), token.getPos(), message.c_str());
+				fflush(stdout);
+			}
 			warning_nodes[token].insert(message);
 		}
 	}
 
+	// Count warnings without printing them
+	void silence() {
+		quiet = true;
+	}
+
+	int warnings() {
+		return warning_count;
+	}
+
+	std::string position(Token token) {
+		return std::string(filename(token)) + ":" + std::to_string(token.getLine()) + ":" + std::to_string(token.getPos());
+	}
+
 	void reportError(const CompileException& exc) {
 		printf("%s:%d:%d: Error: %s\n", filename(exc.getToken()), exc.getToken().getLine(), exc.getToken().getPos(), exc.getMessage().c_str());
 		fflush(stdout);
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+
+// Free lists of memory blocks in power-of-two size classes, one set per
+// thread, so turtles being born and dying do not go to the system
+// allocator. A block can be released on another thread than the one that
+// allocated it. The blocks of a thread are freed when the thread exits.
+class BlockPool {
+	static const int CLASS_COUNT = 17;
+	static const size_t MIN_SIZE = 16;
+
+	struct FreeBlock {
+		FreeBlock *next;
+	};
+
+	FreeBlock *free_lists[CLASS_COUNT] = {};
+	long allocations = 0;
+	long system_allocations = 0;
+	// Bytes allocated minus bytes released by this thread. Only written by
+	// the thread itself, but read by others.
+	std::atomic<long> bytes_in_use;
+
+	void add_bytes(long bytes) {
+		bytes_in_use.store(bytes_in_use.load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed);
+	}
+
+	// Counts of threads that have exited
+	static std::atomic<long>& exited_allocations() {
+		static std::atomic<long> count(0);
+		return count;
+	}
+
+	static std::atomic<long>& exited_system_allocations() {
+		static std::atomic<long> count(0);
+		return count;
+	}
+
+	static int size_class(size_t size) {
+		int c = 0;
+		while (c < CLASS_COUNT && (MIN_SIZE << c) < size) c++;
+		return c;
+	}
+
+	BlockPool() : bytes_in_use(0) {}
+
+public:
+	static BlockPool& local() {
+		static thread_local BlockPool pool;
+		return pool;
+	}
+
+	// Allocations so far by this thread and all exited threads
+	static void counts(long *allocations_out, long *system_allocations_out) {
+		*allocations_out = exited_allocations() + local().allocations;
+		*system_allocations_out = exited_system_allocations() + local().system_allocations;
+	}
+
+	// Bytes allocated minus bytes released by the thread of this pool
+	long bytes() const {
+		return bytes_in_use.load(std::memory_order_relaxed);
+	}
+
+	void *allocate(size_t size) {
+		allocations++;
+		int c = size_class(size);
+		add_bytes(c < CLASS_COUNT ? MIN_SIZE << c : size);
+		if (c < CLASS_COUNT && free_lists[c]) {
+			FreeBlock *block = free_lists[c];
+			free_lists[c] = block->next;
+			return block;
+		}
+		system_allocations++;
+		return ::operator new(c < CLASS_COUNT ? MIN_SIZE << c : size);
+	}
+
+	void release(void *memory, size_t size) {
+		int c = size_class(size);
+		add_bytes(-(long)(c < CLASS_COUNT ? MIN_SIZE << c : size));
+		if (c == CLASS_COUNT) {
+			::operator delete(memory);
+			return;
+		}
+		FreeBlock *block = static_cast<FreeBlock *>(memory);
+		block->next = free_lists[c];
+		free_lists[c] = block;
+	}
+
+	~BlockPool() {
+		for (int c = 0; c < CLASS_COUNT; c++) {
+			while (free_lists[c]) {
+				FreeBlock *block = free_lists[c];
+				free_lists[c] = block->next;
+				::operator delete(block);
+			}
+		}
+		exited_allocations() += allocations;
+		exited_system_allocations() += system_allocations;
+	}
+};
+
+// Allocator for containers of turtle data
+template <typename T>
+struct PoolAllocator {
+	typedef T value_type;
+
+	PoolAllocator() {}
+	template <typename U>
+	PoolAllocator(const PoolAllocator<U>&) {}
+
+	T *allocate(size_t n) {
+		return static_cast<T *>(BlockPool::local().allocate(n * sizeof(T)));
+	}
+
+	void deallocate(T *p, size_t n) {
+		BlockPool::local().release(p, n * sizeof(T));
+	}
+};
+
+template <typename T, typename U>
+bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&) {
+	return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&) {
+	return false;
+}
@@ -40,6 +40,14 @@ static inline int verify(int base, int v, int max, const char *what) {
 #define BC_RSTATE(i)   (verify(0x70, i,     15, "RSTATE")) //  o
 #define BC_CONST(i)    (verify(0x80, i,    126, "CONST"))  //  o
 
+// Fused instructions, in WHEN conditions that are never generated.
+// Each is followed by an operand byte.
+#define BC_OPCONST    0x12  // io  op << 4 | constant index (below 16)
+#define BC_OPLOCAL    0x13  // io  op << 4 | local index
+#define BC_SCC        0x14  // io  condition as for WHEN, gives 0 or 1
+#define BC_MOVESTATE  0x15  //     state offset of move distance
+#define BC_WAITCONST  0x18  //     constant index (below 256)
+
 #define END_OF_SCRIPT 0xFF
 #define BIG_CONSTANT_BASE 126
 
@@ -79,11 +87,18 @@ static inline int verify(int base, int v, int max, const char *what) {
 #define ST_TIME  7
 #define ST_WIRE0 8
 
+// Number of wire slots in the engine (WIRE_CAPACITY in RoseConfig.S)
+#define WIRE_SLOTS 8
+
 // Special stack height to mark tail call
 #define STACK_AFTER_TAIL 0x7A17
 
 typedef unsigned char bytecode_t;
 
+static inline bool is_fused(bytecode_t bc) {
+	return bc == BC_OPCONST || bc == BC_OPLOCAL || bc == BC_SCC || bc == BC_MOVESTATE || bc == BC_WAITCONST;
+}
+
 static inline int stack_change(bytecode_t bc) {
 	static const int single[16] = { 0,0,0,1,0,0,0,1,-1,-1,-1,0,-1,0,-1,-1 };
 	int arg = bc & 15;
@@ -91,6 +106,7 @@ static inline int stack_change(bytecode_t bc) {
 	case 0: // Misc
 		return single[bc];
 	case 1: // WHEN
+		return is_fused(bc) ? 0 : -1;
 	case 3: // OP
 	case 4: // WLOCAL
 	case 5: // WSTATE
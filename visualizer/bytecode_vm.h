@@ -0,0 +1,681 @@
+#pragma once
+
+#include "ast.h"
+#include "bytecode.h"
+#include "turtle_runner.h"
+#include "rose_result.h"
+
+#include <string>
+#include <vector>
+
+// Host implementation of the player engine (engine/Engine.S). Runs the
+// generated bytecodes and constants with the same stack caching, condition
+// flags, scheduling order and arithmetic as the translated 68000 code.
+
+#define VM_STATE_SIZE (ST_WIRE0 + WIRE_SLOTS)
+
+enum class VMOp : unsigned char {
+	CONST, RLOCAL, RSTATE, PROC, RAND,
+	WLOCAL, WSTATE, POP,
+	OP, MUL, DIV, NEG, SINE,
+	WHEN, JUMP, PUSH,
+	FORK, TAIL, END,
+	WAIT, SEED, MOVE, DRAW, PLOT,
+	OPCONST, OPLOCAL, SCC, MOVESTATE, WAITCONST
+};
+
+struct VMInstruction {
+	VMOp op;
+	// Consumes the top of the stack
+	bool input;
+	// Input is popped from the memory stack rather than taken from D0
+	bool pop;
+	// Condition flags are needed by a following WHEN
+	bool flags;
+	unsigned char sub;
+	int arg;
+	int cycles;
+};
+
+struct VMTurtle {
+	number_t st[VM_STATE_SIZE];
+	std::vector<number_t> stack;
+	bool forked;
+};
+
+class BytecodeVM {
+	std::vector<VMInstruction> code;
+	std::vector<int> proc_entry;
+	std::vector<short> sine_table;
+
+	// Execution state
+	RoseStatistics *stats;
+	std::vector<Plot> output;
+	std::vector<VMTurtle> turtles;
+	std::vector<int> free_turtles;
+	std::vector<std::vector<int>> frame_lists;
+	int frame;
+
+	// Condition flags
+	bool flag_n, flag_z, flag_v, flag_c, flag_x;
+
+public:
+	BytecodeVM(const std::vector<bytecode_t>& bytecodes, const std::vector<number_t>& constants) {
+		decode(bytecodes, constants);
+		sine_table.resize(16384);
+		for (int i = 0; i < 16384; i++) {
+			sine_table[i] = TurtleRunner::sin(i);
+		}
+	}
+
+	std::vector<Plot> run(RoseStatistics *stats) {
+		this->stats = stats;
+		output.clear();
+		turtles.clear();
+		free_turtles.clear();
+		frame_lists.assign(stats->frames, std::vector<int>());
+		flag_n = flag_z = flag_v = flag_c = flag_x = false;
+
+		int main = new_turtle();
+		VMTurtle& initial = turtles[main];
+		initial.st[ST_PROC] = proc_entry.empty() ? 0 : proc_entry[0];
+		initial.st[ST_X] = MAKE_NUMBER(0);
+		initial.st[ST_Y] = MAKE_NUMBER(0);
+		initial.st[ST_SIZE] = MAKE_NUMBER(2);
+		initial.st[ST_TINT] = MAKE_NUMBER(1);
+		initial.st[ST_RAND] = 0xBABEFEED;
+		initial.st[ST_DIR] = MAKE_NUMBER(0);
+		initial.st[ST_TIME] = MAKE_NUMBER(0);
+		frame = 0;
+		enqueue(main);
+
+		for (frame = 0; frame < stats->frames; frame++) {
+			std::vector<int>& list = frame_lists[frame];
+			size_t frame_plots = output.size();
+			while (!list.empty()) {
+				int t = list.back();
+				list.pop_back();
+				stats->frame[frame].cpu_compute_cycles += 140;
+				execute(t);
+			}
+			sortFramePlots(output.begin() + frame_plots, output.end());
+		}
+
+		this->stats = nullptr;
+		return std::move(output);
+	}
+
+private:
+	void decode(const std::vector<bytecode_t>& bytecodes, const std::vector<number_t>& constants) {
+		std::vector<int> branches;
+		bool output = false;
+		size_t i = 0;
+		auto next_byte = [&]() {
+			if (i >= bytecodes.size()) {
+				throw Exception("Bytecode ends unexpectedly");
+			}
+			return bytecodes[i++];
+		};
+		auto add = [&](VMOp op, bool input, int arg, int cycles, unsigned char sub = 0) {
+			bool pop = input && !output;
+			bool push = !input && output;
+			if ((op == VMOp::WHEN || op == VMOp::SCC) && !pop) {
+				code.back().flags = true;
+			}
+			code.push_back({op, input, pop, false, sub, arg, cycles + (pop || push ? 12 : 0)});
+		};
+		while (true) {
+			bytecode_t bc = next_byte();
+			if (bc == END_OF_SCRIPT) break;
+			if (code.empty() || code.back().op == VMOp::END) {
+				proc_entry.push_back(code.size());
+			}
+			int arg = bc & 15;
+			bool new_output = false;
+			if (bc & 0x80) {
+				int index = bc & 127;
+				if (index == BIG_CONSTANT_BASE) {
+					index += next_byte();
+				}
+				if (index >= constants.size()) {
+					throw Exception("Constant index out of range: " + std::to_string(index));
+				}
+				add(VMOp::CONST, false, constants[index], 16);
+				new_output = true;
+			} else {
+				switch (bc >> 4) {
+				case 0:
+					switch (bc) {
+					case BC_DONE:
+					case BC_ELSE: {
+						if (branches.empty()) {
+							throw Exception("Unmatched ELSE or DONE");
+						}
+						int branch = branches.back();
+						branches.pop_back();
+						if (bc == BC_ELSE) {
+							add(VMOp::JUMP, false, 0, 10);
+							branches.push_back(code.size() - 1);
+						} else if (output) {
+							add(VMOp::PUSH, false, 0, 0);
+						}
+						code[branch].arg = code.size();
+						break;
+					}
+					case BC_END:
+						add(VMOp::END, false, 0, 40);
+						if (!branches.empty()) {
+							throw Exception("Unterminated WHEN");
+						}
+						break;
+					case BC_RAND:
+						add(VMOp::RAND, false, 0, 144);
+						new_output = true;
+						break;
+					case BC_DRAW:
+						add(VMOp::DRAW, false, 0, 0);
+						break;
+					case BC_TAIL:
+						add(VMOp::TAIL, false, 0, 20);
+						new_output = true;
+						break;
+					case BC_PLOT:
+						add(VMOp::PLOT, false, 0, 0);
+						break;
+					case BC_PROC: {
+						int index = next_byte();
+						add(VMOp::PROC, false, index, 16);
+						new_output = true;
+						break;
+					}
+					case BC_POP:
+						add(VMOp::POP, true, 0, 0);
+						break;
+					case BC_DIV:
+						add(VMOp::DIV, true, 0, 218);
+						new_output = true;
+						break;
+					case BC_WAIT:
+						add(VMOp::WAIT, true, 0, 146);
+						break;
+					case BC_SINE:
+						add(VMOp::SINE, true, 0, 42);
+						new_output = true;
+						break;
+					case BC_SEED:
+						add(VMOp::SEED, true, 0, 204);
+						break;
+					case BC_NEG:
+						add(VMOp::NEG, true, 0, 4);
+						new_output = true;
+						break;
+					case BC_MOVE:
+						add(VMOp::MOVE, true, 0, 0);
+						break;
+					case BC_MUL:
+						add(VMOp::MUL, true, 0, 126);
+						new_output = true;
+						break;
+					}
+					break;
+				case 1:
+					if (is_fused(bc)) {
+						new_output = decodeFused(bc, next_byte(), constants, add);
+						break;
+					}
+					if (arg < 6 || (arg >= 8 && arg < 12)) {
+						throw Exception("Invalid WHEN condition");
+					}
+					add(VMOp::WHEN, true, 0, 0, arg);
+					branches.push_back(code.size() - 1);
+					break;
+				case 2:
+					add(VMOp::FORK, true, arg, 344 + arg * 34);
+					break;
+				case 3:
+					if (arg == 10 || arg == 14 || arg == 15) {
+						throw Exception("Invalid OP instruction: " + std::to_string(arg));
+					}
+					add(VMOp::OP, true, 0, 20, arg);
+					new_output = true;
+					break;
+				case 4:
+					add(VMOp::WLOCAL, true, arg, 16);
+					break;
+				case 5:
+					add(VMOp::WSTATE, true, arg, 16);
+					break;
+				case 6:
+					add(VMOp::RLOCAL, false, arg, 16);
+					new_output = true;
+					break;
+				case 7:
+					add(VMOp::RSTATE, false, arg, 16);
+					new_output = true;
+					break;
+				}
+			}
+			output = new_output;
+		}
+
+		// Resolve procedure references
+		for (VMInstruction& ins : code) {
+			if (ins.op == VMOp::PROC) {
+				if (ins.arg >= proc_entry.size()) {
+					throw Exception("Procedure index out of range: " + std::to_string(ins.arg));
+				}
+				ins.arg = proc_entry[ins.arg];
+			}
+		}
+	}
+
+	// Fused instruction with its operand byte. Returns whether it outputs a
+	// value.
+	template <class Add>
+	bool decodeFused(bytecode_t bc, int operand, const std::vector<number_t>& constants, Add add) {
+		auto constant = [&](int index) {
+			if (index >= constants.size()) {
+				throw Exception("Constant index out of range: " + std::to_string(index));
+			}
+			return constants[index];
+		};
+		int op = operand >> 4;
+		switch (bc) {
+		case BC_OPCONST:
+		case BC_OPLOCAL:
+			if (op == 10 || op == 14 || op == 15) {
+				throw Exception("Invalid OP instruction: " + std::to_string(op));
+			}
+			// The operand is loaded into D1 in place of popping it
+			if (bc == BC_OPCONST) {
+				add(VMOp::OPCONST, true, constant(operand & 15), 24, op);
+			} else {
+				add(VMOp::OPLOCAL, true, operand & 15, 24, op);
+			}
+			return true;
+		case BC_SCC:
+			add(VMOp::SCC, true, 0, 22, operand & 15);
+			return true;
+		case BC_MOVESTATE:
+			if (operand >= VM_STATE_SIZE) {
+				throw Exception("State offset out of range: " + std::to_string(operand));
+			}
+			add(VMOp::MOVESTATE, false, operand, 12);
+			return false;
+		case BC_WAITCONST: {
+			// Immediate add to the time, word sized for whole frames
+			number_t value = constant(operand);
+			add(VMOp::WAITCONST, false, value, 146 - 24 + ((value & 0xFFFF) ? 32 : 20));
+			return false;
+		}
+		}
+		return false;
+	}
+
+	int new_turtle() {
+		int t;
+		if (free_turtles.empty()) {
+			t = turtles.size();
+			turtles.emplace_back();
+		} else {
+			t = free_turtles.back();
+			free_turtles.pop_back();
+		}
+		VMTurtle& turtle = turtles[t];
+		for (int i = 0; i < VM_STATE_SIZE; i++) {
+			turtle.st[i] = 0;
+		}
+		turtle.stack.clear();
+		turtle.forked = false;
+		return t;
+	}
+
+	// Put turtle into the state list for the frame given by its time
+	void enqueue(int t) {
+		short f = NUMBER_TO_INT(turtles[t].st[ST_TIME]);
+		if (f >= stats->frames) {
+			int overwait = f - stats->frames;
+			if (overwait > stats->max_overwait) stats->max_overwait = overwait;
+		}
+		if (f < frame || f >= stats->frames) {
+			// Never run again
+			free_turtles.push_back(t);
+			return;
+		}
+		frame_lists[f].push_back(t);
+	}
+
+	void set_nz(number_t v) {
+		flag_n = v < 0;
+		flag_z = v == 0;
+	}
+
+	void set_logic(number_t v) {
+		set_nz(v);
+		flag_v = false;
+		flag_c = false;
+	}
+
+	bool condition(int cc) {
+		switch (cc) {
+		case 0: return true;
+		case 2: return !flag_c && !flag_z;
+		case 3: return flag_c || flag_z;
+		case 4: return !flag_c;
+		case 5: return flag_c;
+		case 6: return !flag_z;
+		case 7: return flag_z;
+		case 8: return !flag_v;
+		case 9: return flag_v;
+		case 10: return !flag_n;
+		case 11: return flag_n;
+		case 12: return flag_n == flag_v;
+		case 13: return flag_n != flag_v;
+		case 14: return !flag_z && flag_n == flag_v;
+		case 15: return flag_z || flag_n != flag_v;
+		}
+		return false;
+	}
+
+	// op.l d1,d0 with d0 = a and d1 = b, as generated for the OP instruction
+	number_t operate(int op, number_t a, number_t b, bool flags) {
+		unsigned ua = a, ub = b;
+		if (op >= 8) {
+			unsigned r;
+			switch (op) {
+			case OP_OR:
+				r = ua | ub;
+				if (flags) set_logic(r);
+				return r;
+			case OP_AND:
+				r = ua & ub;
+				if (flags) set_logic(r);
+				return r;
+			case OP_ADD:
+				r = ua + ub;
+				if (flags) {
+					set_nz(r);
+					flag_v = ((~(ua ^ ub) & (ua ^ r)) >> 31) != 0;
+					flag_x = flag_c = r < ua;
+				}
+				return r;
+			case OP_SUB:
+			case OP_CMP:
+				r = ua - ub;
+				if (flags) {
+					set_nz(r);
+					flag_v = (((ua ^ ub) & (ua ^ r)) >> 31) != 0;
+					flag_c = ub > ua;
+					if (op == OP_SUB) flag_x = flag_c;
+				}
+				return op == OP_SUB ? r : a;
+			}
+		}
+
+		// Shift or rotate by register, count modulo 64
+		int count = (ub >> 16) & 63;
+		stats->frame[frame].cpu_compute_cycles += count * 2;
+		bool left = (op & 4) != 0;
+		unsigned r = ua;
+		bool c = false, v = false, x = flag_x;
+		for (int i = 0; i < count; i++) {
+			if (left) {
+				bool out = r >> 31;
+				switch (op & 3) {
+				case 0: r <<= 1; v |= out != (r >> 31); break;
+				case 1: r <<= 1; break;
+				case 2: r = (r << 1) | x; break;
+				case 3: r = (r << 1) | out; break;
+				}
+				c = out;
+			} else {
+				bool out = r & 1;
+				switch (op & 3) {
+				case 0: r = (unsigned)((int)r >> 1); break;
+				case 1: r >>= 1; break;
+				case 2: r = (r >> 1) | ((unsigned)x << 31); break;
+				case 3: r = (r >> 1) | ((unsigned)out << 31); break;
+				}
+				c = out;
+			}
+			if ((op & 3) != 3) x = c;
+		}
+		if (flags) {
+			set_nz(r);
+			flag_v = v;
+			if ((op & 3) == 2 && count == 0) c = flag_x;
+			flag_c = c;
+			flag_x = x;
+		}
+		return r;
+	}
+
+	// asl.l #n,d0 as used at the end of several snips
+	number_t shift_left(number_t v, int n, bool flags) {
+		unsigned u = v;
+		number_t r = (number_t)(u << n);
+		if (flags) {
+			set_nz(r);
+			int top = v >> (31 - n);
+			flag_v = top != 0 && top != -1;
+			flag_x = flag_c = (u >> (32 - n)) & 1;
+		}
+		return r;
+	}
+
+	void move(VMTurtle& turtle, number_t distance, FrameStatistics *fs) {
+		number_t dir = turtle.st[ST_DIR];
+		int sa = sine_table[(dir >> 10) & 16383];
+		int ca = sine_table[((dir >> 10) + 4096) & 16383];
+		if (distance < MAKE_NUMBER(32) && distance > -MAKE_NUMBER(32)) {
+			short m = distance >> 6;
+			turtle.st[ST_X] += (m * ca) >> 8;
+			turtle.st[ST_Y] += (m * sa) >> 8;
+			fs->cpu_compute_cycles += 424;
+		} else {
+			short m = (unsigned)distance << 2 >> 16;
+			turtle.st[ST_X] += m * ca;
+			turtle.st[ST_Y] += m * sa;
+			fs->cpu_compute_cycles += distance >= MAKE_NUMBER(32) ? 348 : 366;
+		}
+	}
+
+	// Suspend the turtle until the frame after the wait
+	void wait(int t, VMTurtle& turtle, number_t amount, int pc) {
+		int new_frame = NUMBER_TO_INT(turtle.st[ST_TIME] + amount);
+		for (int f = frame; f < stats->frames && f < new_frame; f++) {
+			stats->frame[f].turtles_survived++;
+			turtle.forked = false;
+		}
+		turtle.st[ST_TIME] += amount;
+		turtle.st[ST_PROC] = pc;
+		enqueue(t);
+	}
+
+	void draw(VMTurtle& turtle, short tint) {
+		short x = NUMBER_TO_INT(turtle.st[ST_X]);
+		short y = NUMBER_TO_INT(turtle.st[ST_Y]);
+		short size = NUMBER_TO_INT(turtle.st[ST_SIZE]);
+		output.push_back({(short)frame, x, y, size, tint});
+		stats->draw(frame, x, y, size);
+	}
+
+	void execute(int t) {
+		FrameStatistics *fs = &stats->frame[frame];
+		VMTurtle *turtle = &turtles[t];
+		int pc = turtle->st[ST_PROC];
+		while (true) {
+			if (pc < 0 || pc >= code.size()) {
+				throw Exception("Jump to invalid address");
+			}
+			const VMInstruction& ins = code[pc++];
+			std::vector<number_t>& stack = turtle->stack;
+			fs->cpu_compute_cycles += ins.cycles;
+			number_t input = 0;
+			if (ins.input) {
+				if (stack.empty()) {
+					throw Exception("Stack underflow");
+				}
+				input = stack.back();
+				stack.pop_back();
+				if (ins.pop) set_logic(input);
+			}
+			switch (ins.op) {
+			case VMOp::CONST:
+			case VMOp::PROC:
+				stack.push_back(ins.arg);
+				if (ins.flags) set_logic(ins.arg);
+				break;
+			case VMOp::RLOCAL:
+				if (ins.arg >= stack.size()) {
+					throw Exception("Local index out of range");
+				}
+				stack.push_back(stack[ins.arg]);
+				if (ins.flags) set_logic(stack.back());
+				break;
+			case VMOp::RSTATE:
+				stack.push_back(turtle->st[ins.arg]);
+				if (ins.flags) set_logic(stack.back());
+				break;
+			case VMOp::RAND: {
+				number_t seed = TurtleRunner::random_iteration(turtle->st[ST_RAND]);
+				turtle->st[ST_RAND] = seed;
+				stack.push_back((seed >> 16) & 0xFFFF);
+				if (ins.flags) set_logic(stack.back());
+				break;
+			}
+			case VMOp::WLOCAL:
+				if (ins.arg >= stack.size()) {
+					throw Exception("Local index out of range");
+				}
+				stack[ins.arg] = input;
+				break;
+			case VMOp::WSTATE:
+				turtle->st[ins.arg] = input;
+				break;
+			case VMOp::POP:
+				break;
+			case VMOp::OPCONST:
+				stack.push_back(operate(ins.sub, input, ins.arg, ins.flags));
+				break;
+			case VMOp::OPLOCAL:
+				if (ins.arg >= stack.size()) {
+					throw Exception("Local index out of range");
+				}
+				stack.push_back(operate(ins.sub, input, stack[ins.arg], ins.flags));
+				break;
+			case VMOp::SCC: {
+				// scc, ext.w, swap, clr.w, neg.l
+				bool truth = !condition(ins.sub);
+				if (truth) fs->cpu_compute_cycles += 2;
+				stack.push_back(truth ? MAKE_NUMBER(1) : 0);
+				if (ins.flags) {
+					set_nz(stack.back());
+					flag_v = false;
+					flag_x = flag_c = truth;
+				}
+				break;
+			}
+			case VMOp::OP:
+			case VMOp::MUL:
+			case VMOp::DIV: {
+				if (stack.empty()) {
+					throw Exception("Stack underflow");
+				}
+				number_t& right = stack.back();
+				if (ins.op == VMOp::OP) {
+					right = operate(ins.sub, input, right, ins.flags);
+				} else if (ins.op == VMOp::MUL) {
+					right = (short)(input >> 8) * (short)(right >> 8);
+					if (ins.flags) set_logic(right);
+				} else {
+					short divisor = right >> 8;
+					if (divisor == 0) {
+						throw Exception("Division by zero");
+					}
+					long long quotient = (long long)input / divisor;
+					if (quotient < -32768 || quotient > 32767) {
+						// Overflow leaves dividend unchanged
+						quotient = (short)input;
+					}
+					right = shift_left((number_t)quotient, 8, ins.flags);
+				}
+				break;
+			}
+			case VMOp::NEG:
+				stack.push_back(-(unsigned)input);
+				if (ins.flags) {
+					set_nz(stack.back());
+					flag_v = input == (number_t)0x80000000;
+					flag_x = flag_c = input != 0;
+				}
+				break;
+			case VMOp::SINE:
+				stack.push_back(shift_left(sine_table[(input & 0xFFFF) >> 2], 2, ins.flags));
+				break;
+			case VMOp::WHEN:
+				// Word branch: 10 cycles taken, 12 not taken
+				if (condition(ins.sub)) {
+					pc = ins.arg;
+					fs->cpu_compute_cycles += 10;
+				} else {
+					fs->cpu_compute_cycles += 12;
+				}
+				break;
+			case VMOp::JUMP:
+				pc = ins.arg;
+				break;
+			case VMOp::PUSH:
+				break;
+			case VMOp::FORK: {
+				if (stack.size() < ins.arg) {
+					throw Exception("Stack underflow");
+				}
+				int child = new_turtle();
+				turtle = &turtles[t];
+				VMTurtle& c = turtles[child];
+				c.st[ST_PROC] = input;
+				for (int i = ST_X; i < VM_STATE_SIZE; i++) {
+					c.st[i] = turtle->st[i];
+				}
+				c.stack.assign(turtle->stack.end() - ins.arg, turtle->stack.end());
+				turtle->stack.resize(turtle->stack.size() - ins.arg);
+				turtle->forked = true;
+				fs->per_wire_cycles += 20;
+				enqueue(child);
+				break;
+			}
+			case VMOp::TAIL:
+				pc = turtle->st[ST_PROC];
+				break;
+			case VMOp::END:
+				if (!turtle->forked) {
+					fs->turtles_died++;
+				}
+				free_turtles.push_back(t);
+				return;
+			case VMOp::WAIT:
+				wait(t, *turtle, input, pc);
+				return;
+			case VMOp::WAITCONST:
+				wait(t, *turtle, ins.arg, pc);
+				return;
+			case VMOp::SEED:
+				turtle->st[ST_RAND] = TurtleRunner::random_iteration(TurtleRunner::random_iteration(input));
+				break;
+			case VMOp::MOVE:
+				move(*turtle, input, fs);
+				break;
+			case VMOp::MOVESTATE:
+				move(*turtle, turtle->st[ins.arg], fs);
+				break;
+			case VMOp::DRAW:
+				draw(*turtle, NUMBER_TO_INT(turtle->st[ST_TINT]));
+				break;
+			case VMOp::PLOT:
+				draw(*turtle, ~NUMBER_TO_INT(turtle->st[ST_TINT]));
+				break;
+			}
+		}
+	}
+};
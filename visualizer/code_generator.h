@@ -4,13 +4,69 @@
 #include "symbol_linking.h"
 #include "translate.h"
 #include "bytecode.h"
+#include "turtle_runner.h"
 
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
+#include <map>
 #include <string>
 #include <algorithm>
+#include <climits>
 
+// Expressions with values known at compile time are folded, and only the
+// branches taken of conditions known at compile time are generated. Temps
+// that are known or never read get no stack slot.
+//
+// Forks with arguments known at compile time fork specialized procedures:
+// copies of the procedure that take only the unknown arguments and have the
+// known ones folded into their code. Specialized procedures are put after
+// the procedures of the program, as long as they fit in the budget.
+// Procedures that can not be reached from the entry procedure are left out.
+//
+// Operations with a constant or local right operand, comparisons used as
+// values, moves by a state variable and waits by a constant are generated
+// as fused instructions.
+//
+// With a profile of the interpretation, the branch of a when statement that
+// ran most is put where the engine branches to, and the constants that ran
+// most as operands are put first, where they fit in fused instructions.
+//
+// The other constants are ordered by how often the code refers to them, so
+// the most used ones fit in a single byte, and constants the code does not
+// refer to are left out. Procedures are put next to the procedure they
+// share the most code sequences with when that makes the packed code
+// smaller.
 class CodeGenerator : private ProgramAdapter {
+	// Specialized procedures may add this percentage of the code size
+	static const int BUDGET_PERCENT = 50;
+	static const int BUDGET_MIN = 256;
+	static const int MAX_PROCEDURES = 256;
+	// Constants with an index below this fit in fused instructions
+	static const int FUSED_CONSTANTS = 16;
+
+	// Interval of the values of an expression, and whether the low 8 bits
+	// are always zero
+	struct Range {
+		int64_t lo, hi;
+		bool coarse;
+	};
+
+	// Local of the procedure being generated: the value if it is known, or
+	// else the stack slot (-1 if never read) and the range of values
+	struct Local {
+		bool known;
+		number_t value;
+		int slot;
+		Range range;
+	};
+
+	struct Specialization {
+		int proc;
+		std::vector<bool> known;
+		std::vector<number_t> values;
+	};
+
 	SymbolLinking& sym;
 	std::vector<int> wire_assignment;
 	std::vector<bytecode_t> out;
@@ -21,26 +77,386 @@ class CodeGenerator : private ProgramAdapter {
 	int op_code;
 	int cmp_code;
 	nodemap<bool> tail_fork;
+	// Comparisons used as conditions rather than values
+	nodemap<bool> condition;
+
+	bool specialize = false;
+	std::vector<int> proc_size;
+	int budget = 0;
+	int specialized_size;
+	std::vector<Specialization> specializations;
+	std::map<std::vector<int64_t>,int> specialization_index;
+	bool constants_added;
+	// Start of each procedure in the code and the procedure references
+	std::vector<int> proc_start;
+	std::vector<std::pair<int,int>> proc_refs;
+
+	// Procedure being generated and its locals
+	int current_proc;
+	std::vector<Local> locals;
+
+	// Times the code being generated ran, and how often each constant ran
+	// as an operand that can be fused, in total and per procedure
+	Profile profile;
+	int64_t runs;
+	std::unordered_map<number_t,int64_t> constant_runs;
+	std::vector<std::unordered_map<number_t,int64_t>> proc_constant_runs;
+	nodemap<std::vector<number_t>> heated;
+	nodemap<bool> inverted;
+	std::vector<number_t> hot_constants;
+
+	// References to each constant in the code, weighted by the runs of the
+	// code referring to it, and references needing the two byte form
+	std::unordered_map<number_t,int> constant_uses;
+	std::unordered_map<number_t,int64_t> constant_weight;
+	int big_constants;
 
 public:
-	CodeGenerator(Reporter& rep, nodemap<AProgram>& parts, SymbolLinking& sym, std::vector<int> wire_assignment, RoseStatistics& stats)
-		: ProgramAdapter(rep, parts), sym(sym), wire_assignment(wire_assignment), stats(stats) {}
+	// Cycles saved per procedure by the layout of branches and constants
+	std::vector<int64_t> saved_cycles;
+
+	// Size of the output, and cycles spent on constant operands that ran
+	struct Layout {
+		int constants;
+		int big_constants;
+		int code_bytes;
+		int packed_bytes;
+		int64_t operand_cycles;
+	};
+	// Before and after ordering constants and procedures for size
+	Layout layout_before, layout_after;
+
+	CodeGenerator(Reporter& rep, nodemap<AProgram>& parts, SymbolLinking& sym, std::vector<int> wire_assignment, RoseStatistics& stats,
+			Profile profile = Profile())
+		: ProgramAdapter(rep, parts), sym(sym), wire_assignment(wire_assignment), stats(stats), profile(profile) {}
 
 	std::pair<std::vector<bytecode_t>,std::vector<number_t>> generate(AProgram program) {
-		visit<AProcDecl>(program);
-		out.push_back(END_OF_SCRIPT);
+		// Unspecialized code gives the size of each procedure
+		generateAll(program);
+		budget = std::max(BUDGET_MIN, (int)out.size() * BUDGET_PERCENT / 100);
+
+		specialize = true;
+		generateAll(program);
+		if (constants_added) {
+			// Folded values were added to the constants
+			sym.sortConstants();
+			generateAll(program);
+		}
+		std::vector<int64_t> constant_saving(sym.procs.size());
+		if (!profile.runs.empty() && placeHotConstants(constant_saving)) {
+			generateAll(program);
+		}
+		layout_before = measure(link(false));
+		if (orderConstants()) {
+			generateAll(program);
+		}
+		// Constants folded again but not referenced come last
+		while (!sym.constants.empty() && constant_uses[sym.constants.back()] == 0) {
+			sym.constant_index.erase(sym.constants.back());
+			sym.constants.pop_back();
+		}
+		std::vector<bytecode_t> code = link(true);
+		layout_after = measure(code);
+		for (int p = 0; p < sym.procs.size(); p++) {
+			saved_cycles[p] += constant_saving[p];
+		}
+		stats.specialized_procedures = specializations.size();
 
-		return make_pair(std::move(out), sym.constants);
+		return make_pair(code, sym.constants);
 	}
 
 private:
+	void generateAll(AProgram program) {
+		out.clear();
+		proc_start.clear();
+		proc_refs.clear();
+		specializations.clear();
+		specialization_index.clear();
+		specialized_size = 0;
+		constants_added = false;
+		current_proc = 0;
+		constant_runs.clear();
+		proc_constant_runs.assign(sym.procs.size(), {});
+		heated = nodemap<std::vector<number_t>>();
+		inverted = nodemap<bool>();
+		saved_cycles.assign(sym.procs.size(), 0);
+		constant_uses.clear();
+		constant_weight.clear();
+		big_constants = 0;
+		visit<AProcDecl>(program);
+		for (int i = 0; i < specializations.size(); i++) {
+			Specialization spec = specializations[i];
+			current_proc = spec.proc;
+			procedure(sym.procs[spec.proc], spec.known, spec.values);
+		}
+	}
+
+	// Put the constants that ran most as fusable operands first, where their
+	// index fits in fused instructions, and leave the others sorted by
+	// value. Returns whether the order changed.
+	bool placeHotConstants(std::vector<int64_t>& saving) {
+		std::vector<std::pair<int64_t,number_t>> hot;
+		for (auto& c : constant_runs) {
+			if (c.second > 0 && sym.constant_index.count(c.first)) {
+				hot.emplace_back(c.second, c.first);
+			}
+		}
+		std::sort(hot.begin(), hot.end(), [](const std::pair<int64_t,number_t>& a, const std::pair<int64_t,number_t>& b) {
+			return a.first != b.first ? a.first > b.first : (unsigned)a.second < (unsigned)b.second;
+		});
+		if (hot.size() > FUSED_CONSTANTS) hot.resize(FUSED_CONSTANTS);
+		std::vector<number_t> first;
+		for (auto& h : hot) {
+			first.push_back(h.second);
+		}
+		hot_constants = first;
+
+		std::unordered_map<number_t,int> old_index = sym.constant_index;
+		sym.sortConstants(first);
+		if (sym.constant_index == old_index) return false;
+
+		// A fused operand saves pushing it and the operation popping it
+		for (int p = 0; p < proc_constant_runs.size(); p++) {
+			for (auto& c : proc_constant_runs[p]) {
+				auto old = old_index.find(c.first);
+				if (old == old_index.end()) continue;
+				int fused = (sym.constant_index[c.first] < FUSED_CONSTANTS) - (old->second < FUSED_CONSTANTS);
+				saving[p] += fused * c.second * ((12 + 16 + 20) - 24);
+			}
+		}
+		return true;
+	}
+
+	// Put the hot constants first and fill the other fused places with the
+	// constants whose references ran most. Order the rest by the number of
+	// references, so the most used ones get single byte references and
+	// fused waits, and leave out the constants with no references. Returns
+	// whether the order changed.
+	bool orderConstants() {
+		std::vector<number_t> order;
+		for (number_t value : hot_constants) {
+			if (constant_uses[value] > 0) order.push_back(value);
+		}
+		std::vector<number_t> rest;
+		for (number_t value : sym.constants) {
+			if (constant_uses[value] > 0 && std::find(order.begin(), order.end(), value) == order.end()) {
+				rest.push_back(value);
+			}
+		}
+		auto by_weight = [&](number_t a, number_t b) {
+			if (constant_weight[a] != constant_weight[b]) return constant_weight[a] > constant_weight[b];
+			if (constant_uses[a] != constant_uses[b]) return constant_uses[a] > constant_uses[b];
+			return (unsigned)a < (unsigned)b;
+		};
+		auto by_uses = [&](number_t a, number_t b) {
+			if (constant_uses[a] != constant_uses[b]) return constant_uses[a] > constant_uses[b];
+			return by_weight(a, b);
+		};
+		std::sort(rest.begin(), rest.end(), by_weight);
+		int fused = std::max(0, std::min<int>(FUSED_CONSTANTS - order.size(), rest.size()));
+		std::sort(rest.begin() + fused, rest.end(), by_uses);
+		order.insert(order.end(), rest.begin(), rest.end());
+
+		if (order == sym.constants) return false;
+		sym.orderConstants(order);
+		return true;
+	}
+
+	int useConstant(int index) {
+		if (index < sym.constants.size()) {
+			constant_uses[sym.constants[index]]++;
+			constant_weight[sym.constants[index]] += runs;
+		}
+		return index;
+	}
+
+	Layout measure(const std::vector<bytecode_t>& code) {
+		// A fused operand takes 24 cycles, and pushing it 12 + 16 more
+		// with the operation popping it taking 20
+		int64_t operand_cycles = 0;
+		for (auto& c : constant_runs) {
+			operand_cycles += c.second * (constantIndex(c.first) < FUSED_CONSTANTS ? 24 : 12 + 16 + 20);
+		}
+		return { (int)sym.constants.size(), big_constants, (int)code.size(), packedSize(code), operand_cycles };
+	}
+
+	// Estimated size of code packed by an LZ packer, where a byte costs 9
+	// bits and a repeat of at least two earlier bytes costs 1 bit and
+	// Elias gamma codes of its offset and length
+	static int packedSize(const std::vector<bytecode_t>& code) {
+		auto gamma = [](int n) {
+			int bits = 1;
+			while (n > 1) {
+				n >>= 1;
+				bits += 2;
+			}
+			return bits;
+		};
+		const int MAX_CANDIDATES = 64;
+		std::vector<std::vector<int>> positions(1 << 16);
+		int n = code.size();
+		int64_t bits = 0;
+		int i = 0;
+		while (i < n) {
+			int length = 0, offset = 0;
+			if (i + 1 < n) {
+				std::vector<int>& chain = positions[code[i] | code[i + 1] << 8];
+				for (int k = chain.size() - 1; k >= 0 && k >= (int)chain.size() - MAX_CANDIDATES; k--) {
+					int p = chain[k];
+					int l = 0;
+					while (i + l < n && code[p + l] == code[i + l]) l++;
+					if (l > length) {
+						length = l;
+						offset = i - p;
+					}
+				}
+			}
+			int repeat_bits = 1 + gamma(offset) + gamma(length - 1);
+			int step = 1;
+			if (length >= 2 && repeat_bits < 9 * length) {
+				bits += repeat_bits;
+				step = length;
+			} else {
+				bits += 9;
+			}
+			for (int k = i; k < i + step && k + 1 < n; k++) {
+				positions[code[k] | code[k + 1] << 8].push_back(k);
+			}
+			i += step;
+		}
+		return (bits + 7) / 8;
+	}
+
+	// Procedures in an order where each follows the one it shares the most
+	// three byte sequences with, starting with the entry procedure
+	std::vector<int> similarOrder(const std::vector<int>& procs) {
+		std::vector<std::unordered_set<uint32_t>> sequences(procs.size());
+		for (int i = 0; i < procs.size(); i++) {
+			int q = procs[i];
+			for (int k = proc_start[q]; k + 2 < proc_start[q + 1]; k++) {
+				sequences[i].insert(out[k] | out[k + 1] << 8 | out[k + 2] << 16);
+			}
+		}
+		std::vector<int> order { procs[0] };
+		std::vector<bool> placed(procs.size(), false);
+		placed[0] = true;
+		int last = 0;
+		for (int n = 1; n < procs.size(); n++) {
+			int best = -1, best_shared = -1;
+			for (int i = 1; i < procs.size(); i++) {
+				if (placed[i]) continue;
+				int shared = 0;
+				for (uint32_t s : sequences[i]) {
+					shared += sequences[last].count(s);
+				}
+				if (shared > best_shared) {
+					best = i;
+					best_shared = shared;
+				}
+			}
+			order.push_back(procs[best]);
+			placed[best] = true;
+			last = best;
+		}
+		return order;
+	}
+
+	// Count the runs of a constant operand that is fused if its index fits
+	void heat(Node node, number_t value) {
+		if (profile.runs.empty()) return;
+		std::vector<number_t>& seen = heated[node];
+		if (std::find(seen.begin(), seen.end(), value) != seen.end()) return;
+		seen.push_back(value);
+		constant_runs[value] += runs;
+		proc_constant_runs[current_proc][value] += runs;
+	}
+
+	// Whether to swap the branches of a when statement. The engine falls
+	// through to the first branch (12 cycles), which jumps over the second
+	// if there is one (10 cycles), and branches to the second (10 cycles).
+	bool invertBranches(AWhenStatement s) {
+		if (profile.runs.empty()) return false;
+		int64_t when_runs = profile.when_runs[s];
+		int64_t else_runs = profile.else_runs[s];
+		int64_t cost = when_runs * (12 + (s.getElse().empty() ? 0 : 10)) + else_runs * 10;
+		int64_t inverted_cost = else_runs * (12 + (s.getWhen().empty() ? 0 : 10)) + when_runs * 10;
+		if (inverted_cost >= cost) return false;
+		if (!inverted[s]) {
+			// Specialized copies share the counts of the statement
+			inverted[s] = true;
+			saved_cycles[current_proc] += cost - inverted_cost;
+		}
+		return true;
+	}
+
+	// Code of the procedures that can be reached from the entry procedure,
+	// numbered again in the same order, or in the order packing best
+	std::vector<bytecode_t> link(bool reorder) {
+		int n = proc_start.size();
+		proc_start.push_back(out.size());
+		std::vector<int> ref_proc;
+		std::vector<std::vector<int>> refs(n);
+		int p = 0;
+		for (auto& ref : proc_refs) {
+			while (ref.first >= proc_start[p + 1]) p++;
+			ref_proc.push_back(p);
+			refs[p].push_back(ref.second);
+		}
+
+		std::vector<bool> reached(n, false);
+		std::vector<int> work { 0 };
+		reached[0] = true;
+		while (!work.empty()) {
+			int q = work.back();
+			work.pop_back();
+			for (int r : refs[q]) {
+				if (!reached[r]) {
+					reached[r] = true;
+					work.push_back(r);
+				}
+			}
+		}
+
+		std::vector<int> procs;
+		for (int q = 0; q < n; q++) {
+			if (reached[q]) procs.push_back(q);
+		}
+		auto place = [&](const std::vector<int>& order) {
+			std::vector<bytecode_t> code;
+			std::vector<int> index(n, -1);
+			std::vector<int> offset(n);
+			for (int i = 0; i < order.size(); i++) {
+				int q = order[i];
+				index[q] = i;
+				offset[q] = code.size() - proc_start[q];
+				code.insert(code.end(), out.begin() + proc_start[q], out.begin() + proc_start[q + 1]);
+			}
+			for (int i = 0; i < proc_refs.size(); i++) {
+				int q = ref_proc[i];
+				if (reached[q]) {
+					code[proc_refs[i].first + offset[q]] = index[proc_refs[i].second];
+				}
+			}
+			code.push_back(END_OF_SCRIPT);
+			return code;
+		};
+		stats.unused_procedures = n - procs.size();
+		std::vector<bytecode_t> code = place(procs);
+		if (reorder && procs.size() > 2) {
+			std::vector<bytecode_t> similar = place(similarOrder(procs));
+			if (packedSize(similar) < packedSize(code)) code = similar;
+		}
+		proc_start.pop_back();
+		return code;
+	}
+
 	void emit(bytecode_t code) {
 		out.push_back(code);
 		if (stack_height == STACK_AFTER_TAIL && code != BC_ELSE && code != BC_DONE && code != BC_END) {
 			throw Exception("Instruction after tail call");
 		}
 		stack_height += stack_change(code);
-		if ((code & 0xF0) == BC_WHEN(0)) {
+		if ((code & 0xF0) == BC_WHEN(0) && !is_fused(code)) {
 			saved_stack_height.push_back(stack_height);
 		} else if (code == BC_ELSE) {
 			std::swap(stack_height, saved_stack_height.back());
@@ -66,13 +482,346 @@ private:
 		}
 	}
 
+	void emit_fused(bytecode_t code, int operand) {
+		emit(code);
+		out.push_back(operand);
+		if (code == BC_OPCONST) useConstant(operand & 15);
+		if (code == BC_WAITCONST) useConstant(operand);
+	}
+
+	int constantIndex(number_t value) {
+		// Literals that never ran have no constant
+		auto constant = sym.constant_index.find(value);
+		return constant != sym.constant_index.end() ? constant->second : 0;
+	}
+
+	// Index of the constant for a value computed at compile time
+	int foldedIndex(Node node, number_t value) {
+		if (sym.constant_index.count(value) == 0) {
+			constants_added = true;
+		}
+		sym.registerConstant(node, value);
+		return constantIndex(value);
+	}
+
+	// Index of the constant for an expression known at compile time
+	int expressionIndex(PExpression exp, number_t value) {
+		return exp.is<ANumberExpression>() ? constantIndex(value) : foldedIndex(exp, value);
+	}
+
 	void emit_constant(int value) {
-		int index = sym.constant_index[value];
+		int index = useConstant(constantIndex(value));
 		if (index < BIG_CONSTANT_BASE) {
 			emit(BC_CONST(index));
 		} else {
 			emit(BC_CONST(BIG_CONSTANT_BASE));
 			out.push_back(index - BIG_CONSTANT_BASE);
+			big_constants++;
+		}
+	}
+
+	// Emit a value computed at compile time
+	void emit_folded(Node node, number_t value) {
+		foldedIndex(node, value);
+		emit_constant(value);
+	}
+
+	void emit_proc_ref(int proc) {
+		emit(BC_PROC);
+		proc_refs.emplace_back(out.size(), proc);
+		out.push_back(proc);
+	}
+
+	bool isKnown(int local) {
+		return local < locals.size() && locals[local].known;
+	}
+
+	// Operator of a binary expression, leaving the current one alone
+	void binaryOperator(ABinaryExpression exp, int *op, int *cmp) {
+		int saved_op_code = op_code, saved_cmp_code = cmp_code;
+		exp.getOp().apply(*this);
+		*op = op_code;
+		*cmp = cmp_code;
+		op_code = saved_op_code;
+		cmp_code = saved_cmp_code;
+	}
+
+	bool foldBinary(int op, int cmp, number_t a, number_t b, number_t *value) {
+		unsigned ua = a, ub = b;
+		int count = (ub >> 16) & 63;
+		if (op == BC_MUL) {
+			*value = (short)(a >> 8) * (short)(b >> 8);
+			return true;
+		}
+		if (op == BC_DIV) {
+			short divisor = b >> 8;
+			if (divisor == 0) return false;
+			long long quotient = (long long)a / divisor;
+			// Overflow is left to the engine
+			if (quotient < -32768 || quotient > 32767) return false;
+			*value = (unsigned)quotient << 8;
+			return true;
+		}
+		switch (op & 15) {
+		case OP_ADD: *value = ua + ub; return true;
+		case OP_SUB: *value = ua - ub; return true;
+		case OP_AND: *value = a & b; return true;
+		case OP_OR:  *value = a | b; return true;
+		case OP_CMP: {
+			bool result = false;
+			switch (cmp) {
+			case CMP_EQ: result = a == b; break;
+			case CMP_NE: result = a != b; break;
+			case CMP_LT: result = a < b; break;
+			case CMP_LE: result = a <= b; break;
+			case CMP_GT: result = a > b; break;
+			case CMP_GE: result = a >= b; break;
+			}
+			*value = result ? MAKE_NUMBER(1) : MAKE_NUMBER(0);
+			return true;
+		}
+		case OP_ASL:
+			if (count >= 32) return false;
+			*value = ua << count;
+			return true;
+		case OP_ASR:
+			if (count >= 32) return false;
+			*value = a >> count;
+			return true;
+		case OP_LSR:
+			if (count >= 32) return false;
+			*value = ua >> count;
+			return true;
+		case OP_ROL:
+			count &= 31;
+			*value = count == 0 ? ua : (ua << count) | (ua >> (32 - count));
+			return true;
+		case OP_ROR:
+			count &= 31;
+			*value = count == 0 ? ua : (ua >> count) | (ua << (32 - count));
+			return true;
+		}
+		return false;
+	}
+
+	// Compute the value of an expression at compile time, with the same
+	// arithmetic as the engine
+	bool fold(PExpression exp, number_t *value) {
+		if (exp.is<ANumberExpression>()) {
+			*value = sym.literal_number[exp];
+			return true;
+		}
+		if (exp.is<AVarExpression>()) {
+			VarRef var = sym.var_ref[exp];
+			if (var.kind == VarKind::FACT) {
+				*value = sym.fact_values[var.index];
+				return true;
+			}
+			if (var.kind == VarKind::LOCAL && isKnown(var.index)) {
+				*value = locals[var.index].value;
+				return true;
+			}
+			return false;
+		}
+		number_t a, b;
+		if (exp.is<ANegExpression>()) {
+			if (!fold(exp.cast<ANegExpression>().getExpression(), &a)) return false;
+			*value = -(unsigned)a;
+			return true;
+		}
+		if (exp.is<ASineExpression>()) {
+			if (!fold(exp.cast<ASineExpression>().getExpression(), &a)) return false;
+			*value = (unsigned)TurtleRunner::sin((a & 0xFFFF) >> 2) << 2;
+			return true;
+		}
+		if (exp.is<ACondExpression>()) {
+			ACondExpression cond = exp.cast<ACondExpression>();
+			if (!fold(cond.getCond(), &a)) return false;
+			return fold(a != 0 ? cond.getWhen() : cond.getElse(), value);
+		}
+		if (exp.is<ABinaryExpression>()) {
+			ABinaryExpression binary = exp.cast<ABinaryExpression>();
+			if (!fold(binary.getLeft(), &a) || !fold(binary.getRight(), &b)) return false;
+			int op, cmp;
+			binaryOperator(binary, &op, &cmp);
+			return foldBinary(op, cmp, a, b, value);
+		}
+		return false;
+	}
+
+	// Range of the values an expression can have
+	Range range(PExpression exp) {
+		const Range full { INT_MIN, INT_MAX, false };
+		number_t value;
+		if (fold(exp, &value)) {
+			return { value, value, (value & 0xFF) == 0 };
+		}
+		if (exp.is<ARandExpression>()) {
+			return { 0, 0xFFFF, false };
+		}
+		if (exp.is<ASineExpression>()) {
+			return { -MAKE_NUMBER(1), MAKE_NUMBER(1), false };
+		}
+		if (exp.is<AVarExpression>()) {
+			VarRef var = sym.var_ref[exp];
+			return var.kind == VarKind::LOCAL ? locals[var.index].range : full;
+		}
+		if (exp.is<ANegExpression>()) {
+			Range r = range(exp.cast<ANegExpression>().getExpression());
+			if (r.lo == INT_MIN) return full;
+			return { -r.hi, -r.lo, r.coarse };
+		}
+		if (exp.is<ACondExpression>()) {
+			ACondExpression cond = exp.cast<ACondExpression>();
+			Range a = range(cond.getWhen());
+			Range b = range(cond.getElse());
+			return { std::min(a.lo, b.lo), std::max(a.hi, b.hi), a.coarse && b.coarse };
+		}
+		if (exp.is<ABinaryExpression>()) {
+			ABinaryExpression binary = exp.cast<ABinaryExpression>();
+			int op, cmp;
+			binaryOperator(binary, &op, &cmp);
+			Range a = range(binary.getLeft());
+			Range b = range(binary.getRight());
+			Range r = full;
+			const int64_t limit = 1 << 23;
+			if (op == BC_OP(OP_CMP)) {
+				r = { 0, MAKE_NUMBER(1), true };
+			} else if (op == BC_OP(OP_ADD)) {
+				r = { a.lo + b.lo, a.hi + b.hi, a.coarse && b.coarse };
+			} else if (op == BC_OP(OP_SUB)) {
+				r = { a.lo - b.hi, a.hi - b.lo, a.coarse && b.coarse };
+			} else if (op == BC_OP(OP_AND)) {
+				r.coarse = a.coarse || b.coarse;
+				if (a.lo >= 0 || b.lo >= 0) {
+					r.lo = 0;
+					r.hi = a.lo >= 0 && b.lo >= 0 ? std::min(a.hi, b.hi) : a.lo >= 0 ? a.hi : b.hi;
+				}
+			} else if (op == BC_DIV) {
+				r = { -limit, limit - 256, true };
+				number_t divisor;
+				if (fold(binary.getRight(), &divisor) && (short)(divisor >> 8) > 0) {
+					int64_t lo = a.lo / (short)(divisor >> 8);
+					int64_t hi = a.hi / (short)(divisor >> 8);
+					if (lo >= -32768 && hi <= 32767) {
+						r = { lo << 8, hi << 8, true };
+					}
+				}
+			} else if (op == BC_MUL && a.lo >= -limit && a.hi < limit && b.lo >= -limit && b.hi < limit) {
+				// Products of the 8.8 operands
+				int64_t p[4] = { (a.lo >> 8) * (b.lo >> 8), (a.lo >> 8) * (b.hi >> 8),
+				                 (a.hi >> 8) * (b.lo >> 8), (a.hi >> 8) * (b.hi >> 8) };
+				r = { *std::min_element(p, p + 4), *std::max_element(p, p + 4), false };
+			}
+			if (r.lo < INT_MIN || r.hi > INT_MAX) return full;
+			return r;
+		}
+		return full;
+	}
+
+	// Whether an expression does nothing besides computing its value
+	bool pure(PExpression exp) {
+		if (exp.is<ARandExpression>()) {
+			return false;
+		}
+		if (exp.is<ANegExpression>()) {
+			return pure(exp.cast<ANegExpression>().getExpression());
+		}
+		if (exp.is<ASineExpression>()) {
+			return pure(exp.cast<ASineExpression>().getExpression());
+		}
+		if (exp.is<ACondExpression>()) {
+			ACondExpression cond = exp.cast<ACondExpression>();
+			return pure(cond.getCond()) && pure(cond.getWhen()) && pure(cond.getElse());
+		}
+		if (exp.is<ABinaryExpression>()) {
+			ABinaryExpression binary = exp.cast<ABinaryExpression>();
+			return pure(binary.getLeft()) && pure(binary.getRight());
+		}
+		return true;
+	}
+
+	void expression(PExpression exp) {
+		number_t value;
+		if (!exp.is<ANumberExpression>() && fold(exp, &value)) {
+			emit_folded(exp, value);
+		} else {
+			exp.apply(*this);
+		}
+	}
+
+	bool foldCondition(PExpression cond, bool *taken) {
+		number_t value;
+		if (!fold(cond, &value)) return false;
+		*taken = value != 0;
+		return true;
+	}
+
+	// Index of the procedure specialized for the known parameters, or -1
+	// if it does not fit in the budget.
+	int specialized(int proc, const std::vector<bool>& proc_known, const std::vector<number_t>& values) {
+		std::vector<int64_t> key { proc };
+		for (int i = 0; i < proc_known.size(); i++) {
+			key.push_back(proc_known[i] ? (int64_t)(uint32_t)values[i] : -1);
+		}
+		auto existing = specialization_index.find(key);
+		if (existing != specialization_index.end()) {
+			return existing->second;
+		}
+		int index = sym.procs.size() + specializations.size();
+		if (index >= MAX_PROCEDURES || specialized_size + proc_size[proc] > budget) {
+			return -1;
+		}
+		specializations.push_back({proc, proc_known, values});
+		specialization_index[key] = index;
+		specialized_size += proc_size[proc];
+		return index;
+	}
+
+	// Procedure forked by a statement and the arguments to pass to it.
+	// Returns -1 if the procedure is only known at run time.
+	int forkTarget(AForkStatement s, std::vector<PExpression>& args) {
+		int target = -1;
+		if (s.getProc().is<AVarExpression>()) {
+			VarRef var = sym.var_ref[s.getProc()];
+			if (var.kind == VarKind::PROCEDURE) target = var.index;
+		}
+		args.clear();
+		for (PExpression exp : s.getArgs()) {
+			args.push_back(exp);
+		}
+		if (!specialize || target < 0 || sym.procs[target].getParams().size() != args.size()) {
+			return target;
+		}
+
+		std::vector<bool> arg_known(args.size());
+		std::vector<number_t> values(args.size());
+		bool any_known = false;
+		for (int i = 0; i < args.size(); i++) {
+			arg_known[i] = fold(args[i], &values[i]);
+			if (target == current_proc) {
+				// Only parameters passed on unchanged, to not unroll recursion
+				arg_known[i] = arg_known[i] && isKnown(i) && locals[i].value == values[i];
+			}
+			any_known |= arg_known[i];
+		}
+		if (!any_known) return target;
+		int index = specialized(target, arg_known, values);
+		if (index < 0) return target;
+
+		std::vector<PExpression> unknown_args;
+		for (int i = 0; i < args.size(); i++) {
+			if (!arg_known[i]) unknown_args.push_back(args[i]);
+		}
+		args = std::move(unknown_args);
+		return index;
+	}
+
+	void emit_proc(int target, AForkStatement s) {
+		if (target < 0) {
+			expression(s.getProc());
+		} else {
+			emit_proc_ref(target);
 		}
 	}
 
@@ -90,12 +839,30 @@ private:
 		}
 	}
 
-	void caseAProcDecl(AProcDecl proc) override {
+	void procedure(AProcDecl proc, const std::vector<bool>& proc_known, const std::vector<number_t>& values) {
+		locals.clear();
+		stack_height = 0;
+		for (int i = 0; i < proc.getParams().size(); i++) {
+			if (i < proc_known.size() && proc_known[i]) {
+				number_t value = values[i];
+				locals.push_back({ true, value, -1, { value, value, (value & 0xFF) == 0 } });
+			} else {
+				locals.push_back({ false, 0, stack_height++, { INT_MIN, INT_MAX, false } });
+			}
+		}
 		List<PStatement>& body = proc.getBody();
 		if (!body.empty()) mark_tail(body.back());
-		stack_height = proc.getParams().size();
+		runs = current_proc < profile.runs.size() ? profile.runs[current_proc] : 0;
+		int start = out.size();
+		proc_start.push_back(start);
 		proc.getBody().apply(*this);
-		emit(BC_END);		
+		emit(BC_END);
+		if (!specialize) proc_size.push_back(out.size() - start);
+	}
+
+	void caseAProcDecl(AProcDecl proc) override {
+		procedure(proc, {}, {});
+		current_proc++;
 	}
 
 	void caseAPlusBinop(APlusBinop)         override { op_code = BC_OP(OP_ADD); cmp_code = CMP_NE; }
@@ -116,18 +883,124 @@ private:
 	void caseAAndBinop(AAndBinop)           override { op_code = BC_OP(OP_AND); cmp_code = CMP_NE; }
 	void caseAOrBinop(AOrBinop)             override { op_code = BC_OP(OP_OR);  cmp_code = CMP_NE; }
 
+	// Multiply or divide by a power of two as shifts, where that gives the
+	// same result as the 8.8 multiply or divide of the engine
+	bool reduceStrength(ABinaryExpression exp) {
+		int op, cmp;
+		binaryOperator(exp, &op, &cmp);
+		if (op != BC_MUL && op != BC_DIV) return false;
+		PExpression operand = exp.getLeft();
+		number_t factor;
+		if (!fold(exp.getRight(), &factor)) {
+			if (op == BC_DIV || !fold(exp.getLeft(), &factor)) return false;
+			operand = exp.getRight();
+		}
+		if (factor <= 0 || (factor & (factor - 1)) != 0) return false;
+		int shift = -16;
+		while ((1 << (shift + 16)) != factor) shift++;
+		if (shift < -8 || shift > 6) return false;
+
+		Range r = range(operand);
+		std::vector<std::pair<int,number_t>> ops;
+		if (op == BC_MUL) {
+			// (a & ~$FF) << shift when a fits in 24 bits
+			if (r.lo < -(1 << 23) || r.hi >= (1 << 23)) return false;
+			if (!r.coarse) ops.emplace_back(OP_AND, ~0xFF);
+			if (shift > 0) ops.emplace_back(OP_ASL, MAKE_NUMBER(shift));
+			if (shift < 0) ops.emplace_back(OP_ASR, MAKE_NUMBER(-shift));
+		} else {
+			// (a >> shift) & ~$FF when a is positive and the quotient fits
+			// in 16 bits
+			if (r.lo < 0 || r.hi >= (int64_t)1 << (23 + shift)) return false;
+			if (shift > 0) ops.emplace_back(OP_ASR, MAKE_NUMBER(shift));
+			if (shift < 0) ops.emplace_back(OP_ASL, MAKE_NUMBER(-shift));
+			ops.emplace_back(OP_AND, ~0xFF);
+		}
+		operations(exp, operand, ops);
+		cmp_code = CMP_NE;
+		return true;
+	}
+
+	// Apply operations with constant right operands in turn to an operand.
+	// Constants that do not fit in a fused instruction go on the stack
+	// first.
+	void operations(Node node, PExpression operand, const std::vector<std::pair<int,number_t>>& ops) {
+		std::vector<int> index;
+		for (auto& op : ops) {
+			index.push_back(foldedIndex(node, op.second));
+			heat(node, op.second);
+		}
+		for (int i = ops.size() - 1; i >= 0; i--) {
+			if (index[i] >= FUSED_CONSTANTS) emit_constant(ops[i].second);
+		}
+		expression(operand);
+		for (int i = 0; i < ops.size(); i++) {
+			if (index[i] < FUSED_CONSTANTS) {
+				emit_fused(BC_OPCONST, ops[i].first << 4 | index[i]);
+			} else {
+				emit(BC_OP(ops[i].first));
+			}
+		}
+	}
+
+	// Fused instruction and operand index for an operation with a constant
+	// or local right operand
+	bool fusedOperand(PExpression exp, bytecode_t *code, int *index) {
+		number_t value;
+		if (fold(exp, &value)) {
+			*code = BC_OPCONST;
+			*index = expressionIndex(exp, value);
+			heat(exp, value);
+			return *index < FUSED_CONSTANTS;
+		}
+		if (exp.is<AVarExpression>()) {
+			VarRef var = sym.var_ref[exp];
+			if (var.kind == VarKind::LOCAL && locals[var.index].slot >= 0) {
+				*code = BC_OPLOCAL;
+				*index = locals[var.index].slot;
+				return true;
+			}
+		}
+		return false;
+	}
+
 	void caseABinaryExpression(ABinaryExpression exp) override {
-		exp.getRight().apply(*this);
-		exp.getLeft().apply(*this);
-		exp.getOp().apply(*this);
-		emit(op_code);
-		if (op_code == BC_OP(OP_CMP) && !exp.parent().is<AWhenStatement>() && !exp.parent().is<ACondExpression>()) {
+		if (reduceStrength(exp)) return;
+		int op, cmp;
+		binaryOperator(exp, &op, &cmp);
+		PExpression left = exp.getLeft();
+		PExpression right = exp.getRight();
+		bytecode_t fused;
+		int index;
+		bool fuse = false;
+		if (op != BC_MUL && op != BC_DIV) {
+			fuse = fusedOperand(right, &fused, &index);
+			bool symmetric = op == BC_OP(OP_ADD) || op == BC_OP(OP_AND) || op == BC_OP(OP_OR) || op == BC_OP(OP_CMP);
+			if (!fuse && symmetric && fusedOperand(left, &fused, &index)) {
+				fuse = true;
+				std::swap(left, right);
+				switch (cmp) {
+				case CMP_LT: cmp = CMP_GT; break;
+				case CMP_GT: cmp = CMP_LT; break;
+				case CMP_LE: cmp = CMP_GE; break;
+				case CMP_GE: cmp = CMP_LE; break;
+				}
+			}
+		}
+		if (fuse) {
+			expression(left);
+			emit_fused(fused, (op & 15) << 4 | index);
+		} else {
+			expression(right);
+			expression(left);
+			emit(op);
+		}
+		op_code = op;
+		cmp_code = cmp;
+		if (op == BC_OP(OP_CMP) && !condition[exp]) {
 			// Produce truth value
-			emit(BC_WHEN(cmp_code));
-			emit_constant(MAKE_NUMBER(1));
-			emit(BC_ELSE);
-			emit_constant(MAKE_NUMBER(0));
-			emit(BC_DONE);
+			emit_fused(BC_SCC, cmp_code);
+			cmp_code = CMP_NE;
 		}
 	}
 
@@ -139,43 +1012,48 @@ private:
 		VarRef var = sym.var_ref[exp];
 		switch (var.kind) {
 		case VarKind::GLOBAL:
-			switch (static_cast<GlobalKind>(var.index)) {
-			case GlobalKind::X:
-				emit(BC_RSTATE(ST_X));
-				break;
-			case GlobalKind::Y:
-				emit(BC_RSTATE(ST_Y));
-				break;
-			case GlobalKind::DIRECTION:
-				emit(BC_RSTATE(ST_DIR));
-				break;
-			}
+		case VarKind::WIRE:
+			emit(BC_RSTATE(stateOffset(exp)));
 			break;
 		case VarKind::LOCAL:
-			emit(BC_RLOCAL(var.index));
-			break;
-		case VarKind::WIRE: {
-			int index = wire_assignment[var.index];
-			emit(BC_RSTATE(ST_WIRE0 + index));
+			emit(BC_RLOCAL(locals[var.index].slot));
 			break;
-		}
 		case VarKind::FACT:
 			emit_constant(sym.fact_values[var.index]);
 			break;
 		case VarKind::PROCEDURE:
-			emit(BC_PROC);
-			out.push_back(var.index);
+			emit_proc_ref(var.index);
 			break;
 		}
 	}
 
+	// State offset read by an expression, or -1 if it is not a state variable
+	int stateOffset(PExpression exp) {
+		if (!exp.is<AVarExpression>()) return -1;
+		VarRef var = sym.var_ref[exp];
+		if (var.kind == VarKind::GLOBAL) {
+			switch (static_cast<GlobalKind>(var.index)) {
+			case GlobalKind::X:
+				return ST_X;
+			case GlobalKind::Y:
+				return ST_Y;
+			case GlobalKind::DIRECTION:
+				return ST_DIR;
+			}
+		}
+		if (var.kind == VarKind::WIRE) {
+			return ST_WIRE0 + wire_assignment[var.index];
+		}
+		return -1;
+	}
+
 	void caseANegExpression(ANegExpression exp) override {
-		exp.getExpression().apply(*this);
+		expression(exp.getExpression());
 		emit(BC_NEG);
 	}
 
 	void caseASineExpression(ASineExpression exp) override {
-		exp.getExpression().apply(*this);
+		expression(exp.getExpression());
 		emit(BC_SINE);
 	}
 
@@ -184,69 +1062,100 @@ private:
 	}
 
 	void caseACondExpression(ACondExpression exp) override {
+		bool taken;
+		if (foldCondition(exp.getCond(), &taken)) {
+			expression(taken ? exp.getWhen() : exp.getElse());
+			return;
+		}
 		cmp_code = CMP_NE;
-		exp.getCond().apply(*this);
+		condition[exp.getCond()] = true;
+		expression(exp.getCond());
 		emit(BC_WHEN(cmp_code));
-		exp.getWhen().apply(*this);
+		expression(exp.getWhen());
 		emit(BC_ELSE);
-		exp.getElse().apply(*this);
+		expression(exp.getElse());
 		emit(BC_DONE);
 	}
 
 	void caseAWhenStatement(AWhenStatement s) override {
+		bool taken;
+		if (foldCondition(s.getCond(), &taken)) {
+			// Only the branch taken
+			int height = stack_height;
+			(taken ? s.getWhen() : s.getElse()).apply(*this);
+			if (stack_height != STACK_AFTER_TAIL) {
+				pop(stack_height - height);
+			}
+			return;
+		}
 		cmp_code = CMP_NE;
-		s.getCond().apply(*this);
-		emit(BC_WHEN(cmp_code));
-		s.getWhen().apply(*this);
+		condition[s.getCond()] = true;
+		expression(s.getCond());
+		bool invert = invertBranches(s);
+		emit(BC_WHEN(invert ? cmp_code ^ 1 : cmp_code));
+		List<PStatement>& first = invert ? s.getElse() : s.getWhen();
+		List<PStatement>& second = invert ? s.getWhen() : s.getElse();
+		int64_t outer_runs = runs;
+		// Pop the temps of the branches that got a stack slot
+		int height = stack_height;
+		runs = invert ? profile.else_runs[s] : profile.when_runs[s];
+		first.apply(*this);
 		if (stack_height != STACK_AFTER_TAIL) {
-			pop(sym.when_pop[s]);
+			pop(stack_height - height);
 		}
-		if (!s.getElse().empty()) {
+		if (!second.empty()) {
 			emit(BC_ELSE);
-			s.getElse().apply(*this);
+			runs = invert ? profile.when_runs[s] : profile.else_runs[s];
+			second.apply(*this);
 			if (stack_height != STACK_AFTER_TAIL) {
-				pop(sym.else_pop[s]);
+				pop(stack_height - height);
 			}
 		}
+		runs = outer_runs;
 		emit(BC_DONE);
 	}
 
-	bool makeTailCall(AForkStatement s) {
+	bool makeTailCall(AForkStatement s, int target, const std::vector<PExpression>& fork_args) {
 		if (tail_fork[s]) {
-			// Not enough space for arguments?
-			if (s.getArgs().size() > stack_height) {
-				//rep.reportWarning(s.getToken(), "Tail fork not optimized because of too little stack space");
-				return false;
+			// Arguments beyond the locals are pushed before the others are
+			// written, as specialized procedures have fewer locals. That
+			// changes the order of evaluation, so the others must not use
+			// rand.
+			int slots = stack_height;
+			for (int i = 0; i < slots && slots < fork_args.size(); i++) {
+				if (!pure(fork_args[i])) return false;
+			}
+			for (int i = slots; i < fork_args.size(); i++) {
+				expression(fork_args[i]);
 			}
 
 			// Find non-identity arguments
 			std::vector<std::pair<int,PExpression>> args;
-			int index = 0;
-			for (PExpression exp : s.getArgs()) {
+			for (int index = 0; index < slots && index < fork_args.size(); index++) {
+				PExpression exp = fork_args[index];
 				bool identity = false;
 				if (exp.is<AVarExpression>()) {
 					VarRef var = sym.var_ref[exp];
-					if (var.kind == VarKind::LOCAL && var.index == index) {
+					if (var.kind == VarKind::LOCAL && !isKnown(var.index) && locals[var.index].slot == index) {
 						identity = true;
 					}
 				}
 				if (!identity) {
 					args.emplace_back(index, exp);
 				}
-				index++;
 			}
 
 			// Generate code
-			s.getProc().apply(*this);
+			emit_proc(target, s);
 			for (auto& a : args) {
-				a.second.apply(*this);
+				expression(a.second);
 			}
 			std::reverse(args.begin(), args.end());
 			for (auto& a : args) {
 				emit(BC_WLOCAL(a.first));
 			}
 			emit(BC_WSTATE(ST_PROC));
-			pop(stack_height - s.getArgs().size());
+			pop(stack_height - fork_args.size());
 			emit(BC_TAIL);
 
 			return true;
@@ -255,57 +1164,98 @@ private:
 	}
 
 	void caseAForkStatement(AForkStatement s) override {
-		if (!makeTailCall(s)) {
-			s.getArgs().apply(*this);
-			s.getProc().apply(*this);
-			emit(BC_FORK(s.getArgs().size()));
+		std::vector<PExpression> args;
+		int target = forkTarget(s, args);
+		if (!makeTailCall(s, target, args)) {
+			for (PExpression exp : args) {
+				expression(exp);
+			}
+			emit_proc(target, s);
+			emit(BC_FORK(args.size()));
 		}
 	}
 
 	void caseATempStatement(ATempStatement s) override {
-		s.getExpression().apply(*this);
+		int index = sym.temp_local[s];
+		if (index >= locals.size()) {
+			locals.resize(index + 1);
+		}
+		number_t value;
+		if (fold(s.getExpression(), &value)) {
+			locals[index] = { true, value, -1, { value, value, (value & 0xFF) == 0 } };
+		} else if (sym.temp_reads[s] == 0 && pure(s.getExpression())) {
+			locals[index] = { false, 0, -1, { INT_MIN, INT_MAX, false } };
+		} else {
+			Range r = range(s.getExpression());
+			int slot = stack_height;
+			expression(s.getExpression());
+			locals[index] = { false, 0, slot, r };
+		}
 	}
 
 	void caseAWireStatement(AWireStatement s) override {
 		int index = wire_assignment[sym.wire_index[s]];
-		s.getExpression().apply(*this);
+		if (index >= WIRE_SLOTS) {
+			throw CompileException(s.getVar().cast<ALocal>().getName(), "Too many wires in use at the same time");
+		}
+		expression(s.getExpression());
 		emit(BC_WSTATE(ST_WIRE0 + index));
 	}
 
 	void caseAWaitStatement(AWaitStatement s) override {
-		s.getExpression().apply(*this);
+		number_t value;
+		if (fold(s.getExpression(), &value)) {
+			int index = expressionIndex(s.getExpression(), value);
+			if (index < 256) {
+				emit_fused(BC_WAITCONST, index);
+				return;
+			}
+		}
+		expression(s.getExpression());
 		emit(BC_WAIT);
 	}
 
 	void caseATurnStatement(ATurnStatement s) override {
-		s.getExpression().apply(*this);
-		emit(BC_RSTATE(ST_DIR));
-		emit(BC_OP(OP_ADD));
+		bytecode_t fused;
+		int index;
+		if (fusedOperand(s.getExpression(), &fused, &index)) {
+			emit(BC_RSTATE(ST_DIR));
+			emit_fused(fused, OP_ADD << 4 | index);
+		} else {
+			expression(s.getExpression());
+			emit(BC_RSTATE(ST_DIR));
+			emit(BC_OP(OP_ADD));
+		}
 		emit(BC_WSTATE(ST_DIR));
 	}
 
 	void caseAFaceStatement(AFaceStatement s) override {
-		s.getExpression().apply(*this);
+		expression(s.getExpression());
 		emit(BC_WSTATE(ST_DIR));
 	}
 
 	void caseASizeStatement(ASizeStatement s) override {
-		s.getExpression().apply(*this);
+		expression(s.getExpression());
 		emit(BC_WSTATE(ST_SIZE));
 	}
 
 	void caseATintStatement(ATintStatement s) override {
-		s.getExpression().apply(*this);
+		expression(s.getExpression());
 		emit(BC_WSTATE(ST_TINT));
 	}
 
 	void caseASeedStatement(ASeedStatement s) override {
-		s.getExpression().apply(*this);
+		expression(s.getExpression());
 		emit(BC_SEED);
 	}
 
 	void caseAMoveStatement(AMoveStatement s) override {
-		s.getExpression().apply(*this);
+		int offset = stateOffset(s.getExpression());
+		if (offset >= 0 && offset < ST_WIRE0 + WIRE_SLOTS) {
+			emit_fused(BC_MOVESTATE, offset);
+			return;
+		}
+		expression(s.getExpression());
 		emit(BC_MOVE);
 	}
 
@@ -321,8 +1271,8 @@ private:
 			same_y = var.kind == VarKind::GLOBAL
 			      && static_cast<GlobalKind>(var.index) == GlobalKind::Y;
 		}
-		if (!same_y) s.getY().apply(*this);
-		if (!same_x) s.getX().apply(*this);
+		if (!same_y) expression(s.getY());
+		if (!same_x) expression(s.getX());
 		if (!same_x) emit(BC_WSTATE(ST_X));
 		if (!same_y) emit(BC_WSTATE(ST_Y));
 	}
@@ -3,79 +3,146 @@
 #include "ast.h"
 #include "symbol_linking.h"
 #include "translate.h"
-
-#include <functional>
+#include "threaded_code.h"
+#include "type_inference.h"
+#include "turtle_runner.h"
+#include "turtle_batch.h"
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <condition_variable>
+#include <cstdint>
 #include <cstring>
-#include <queue>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
+#include <algorithm>
 #include <utility>
 
-typedef uint64_t wire_mask_t;
-
-enum class ValueKind {
-	NUMBER,
-	PROCEDURE
-};
-
-struct Value {
-	ValueKind kind;
-	union {
-		number_t number;
-		AProcDecl proc;
+// Interpretation kept for the next translation of the same program. When
+// some procedures have changed, or more frames are wanted, interpretation
+// resumes from the last checkpoint before any changed procedure first ran.
+struct InterpretRecord {
+	static const int CHECKPOINT_INTERVAL = 250;
+
+	// Everything alive at the start of a frame
+	struct Checkpoint {
+		struct Pending {
+			int frame;
+			FrameStatistics stats;
+			StateList turtles;
+		};
+
+		int frame;
+		size_t plots;
+		int max_overwait;
+		WireConflicts wire_conflicts;
+		// Execution counts up to this frame, as in TurtleRunner::counts
+		std::vector<int64_t> counts;
+		// Statistics and waiting turtles of this and later frames. Only
+		// frames with any of these are included.
+		std::vector<Pending> pending;
 	};
 
-	explicit Value(AProcDecl proc, bool is_procedure) : kind(ValueKind::PROCEDURE), proc(proc) {}
-	explicit Value(number_t number) : kind(ValueKind::NUMBER), number(number) {}
-	Value() : Value(0) {}
-	Value(const Value& value) {
-		memcpy(this, &value, sizeof(Value));
-	}
-	const Value& operator=(const Value& value) {
-		return * new (this) Value(value);
-	}
-	~Value() {}
+	bool valid = false;
+	// Number of frames interpreted
+	int end;
+	bool coalesce;
+
+	// Shape of the program and animation
+	int frames, width, height, layer_count, layer_depth;
+	int wire_count;
+	std::vector<std::string> proc_names;
+	std::vector<int> proc_params;
+
+	// Per procedure: hash of its code, entry point, first literal slot and
+	// first frame where it ran
+	std::vector<uint64_t> proc_hash;
+	std::vector<int> proc_entry;
+	std::vector<int> proc_literals;
+	std::vector<int> proc_first_frame;
+	// First frame where each literal was registered, or -1
+	std::vector<int> literal_frame;
+
+	std::vector<Plot> plots;
+	std::vector<FrameStatistics> stats;
+	std::vector<Checkpoint> checkpoints;
 };
 
-struct State {
-	AProcDecl proc;
-	number_t time;
-	number_t x,y;
-	number_t size;
-	number_t direction;
-	number_t tint;
-	number_t seed;
-	std::vector<Value> stack;
-	std::vector<Value> wire_values;
-	wire_mask_t wires_set;
-	std::vector<wire_mask_t> wires_written_since;
-
-	State() {}
-	State(AProcDecl proc, State& parent, std::vector<Value> stack)
-	: proc(proc), stack(std::move(stack)), wire_values(parent.wire_values) {
-		time = parent.time;
-		x = parent.x;
-		y = parent.y;
-		size = parent.size;
-		direction = parent.direction;
-		tint = parent.tint;
-		seed = parent.seed;
-		wires_set = parent.wires_set;
-		wires_written_since = parent.wires_written_since;
-	}
-
-	State(State&& state) = default;
-	State& operator=(State&& state) = default;
-};
-
-class Interpreter : private ReturningAdapter<Value> {
+class Interpreter {
 	Reporter& rep;
 	SymbolLinking& sym;
-	State state;
-	std::queue<State> pending;
+	// Turtles to run, per frame
+	std::vector<StateList> state_lists;
 	std::vector<Plot> output;
 	RoseStatistics *stats;
-	bool forked_in_frame;
-	bool procedure_phase;
+
+	// Compiled code
+	ThreadedCode code;
+	Lowering lowering;
+	nodemap<int> expression_entry;
+
+	// Where each procedure and literal first ran, for resuming later
+	int current_frame;
+	std::vector<int> proc_first_frame;
+	std::vector<int> proc_literals;
+	std::vector<int> literal_frame;
+	std::vector<number_t> literal_value;
+
+	// Execution counts of the procedure code, without those of the runners
+	std::vector<int64_t> counts;
+
+	// Execution. The first runner also evaluates expressions.
+	bool use_jit;
+	bool use_batch;
+	bool coalesce;
+	int stop_frame;
+	int n_threads;
+
+	std::vector<FactOverride> fact_overrides;
+
+	// Trace output, while tracing
+	std::string trace_file;
+	std::unique_ptr<TraceWriter> trace;
+	uint32_t next_turtle_id;
+
+	// Limits, and how far interpretation is from them
+	long max_turtles;
+	long max_runs;
+	double max_seconds;
+	long max_memory;
+	const std::atomic<bool> *cancel;
+	long live_turtles;
+	long runs;
+	std::chrono::steady_clock::time_point start_time;
+	std::vector<std::unique_ptr<TurtleRunner>> runners;
+	std::vector<std::unique_ptr<TurtleBatch>> batches;
+	std::vector<TurtleEffects> effects;
+
+	// Worker threads, running chunks of the current generation of turtles
+	static const int CHUNK_SIZE = TurtleBatch::LANES;
+	static const int MIN_BATCH = 4;
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	// Block pools of the threads running turtles for this interpretation,
+	// with their bytes in use when they started. Only these count towards
+	// the memory limit, so interpretations running side by side in a sweep
+	// do not take from each other's limit.
+	std::vector<std::pair<BlockPool *, long>> pools;
+	std::condition_variable wake, done;
+	int generation = 0;
+	int busy = 0;
+	bool quit = false;
+	StateList *job_list;
+	size_t job_begin, job_end, job_chunks;
+	std::atomic<size_t> next_chunk;
+
+	// First turtle with each hash, for coalescing
+	std::unordered_map<uint64_t, size_t> first_turtle;
 
 	// Temp state for color script calculation
 	std::vector<TintColor> colors;
@@ -158,7 +225,7 @@ class Interpreter : private ReturningAdapter<Value> {
 			} else if (event.is<AWaitEvent>()) {
 				if (is_fading) do_fade();
 				PExpression waitexp = event.cast<AWaitEvent>().getExpression();
-				Value wait = apply(waitexp);
+				Value wait = evaluate(waitexp);
 				time += wait.number;
 			} else if (event.is<AFadeEvent>()) {
 				if (is_fading) do_fade();
@@ -166,7 +233,7 @@ class Interpreter : private ReturningAdapter<Value> {
 				fade_time = time;
 				is_fading = true;
 				PExpression waitexp = event.cast<AFadeEvent>().getExpression();
-				Value wait = apply(waitexp);
+				Value wait = evaluate(waitexp);
 				time += wait.number;
 			} else if (event.is<ARefEvent>()) {
 				TIdentifier id = event.cast<ARefEvent>().getName();
@@ -186,533 +253,643 @@ class Interpreter : private ReturningAdapter<Value> {
 		}
 	}
 
-public:
-	std::vector<wire_mask_t> wire_conflicts;
-
-	Interpreter(Reporter& rep, SymbolLinking& sym)
-		: rep(rep), sym(sym), stats(nullptr), wire_conflicts(sym.wire_count) {}
-
-	std::vector<Plot> interpret(AProcDecl main, RoseStatistics *stats) {
-		this->stats = stats;
-
-		procedure_phase = false;
-		AProgram prog = main.parent().cast<AProgram>();
-		sym.fact_values.clear();
-		sym.traverse<AFactDecl>(prog, [&](AFactDecl fact) {
-			Value fact_value = apply(fact.getExpression());
-			sym.fact_values.push_back(fact_value.number);
-		});
+	void addPool() {
+		BlockPool& pool = BlockPool::local();
+		std::lock_guard<std::mutex> lock(mutex);
+		pools.emplace_back(&pool, pool.bytes());
+	}
 
-		State initial;
-		initial.proc = main;
-		initial.time = MAKE_NUMBER(0);
-		initial.x = MAKE_NUMBER(0);
-		initial.y = MAKE_NUMBER(0);
-		initial.size = MAKE_NUMBER(2);
-		initial.direction = MAKE_NUMBER(0);
-		initial.tint = MAKE_NUMBER(1);
-		initial.seed = 0xBABEFEED;
-		initial.wire_values.resize(sym.wire_count);
-		initial.wires_set = 0;
-		initial.wires_written_since.resize(sym.wire_count);
-		pending.push(std::move(initial));
-
-		procedure_phase = true;
-		while (!pending.empty()) {
-			state = std::move(pending.front());
-			pending.pop();
-			short f = NUMBER_TO_INT(state.time);
-			if (f >= 0 && f < stats->frames) {
-				cpu(140);
-				forked_in_frame = false;
-				state.proc.getBody().apply(*this);
-				if (!forked_in_frame) {
-					stats->frame[f].turtles_died++;
-					cpu(40);
-				}
-			} else {
-				int overwait = f - stats->frames;
-				if (overwait > stats->max_overwait) stats->max_overwait = overwait;
-			}
+	long memoryInUse() {
+		std::lock_guard<std::mutex> lock(mutex);
+		long bytes = 0;
+		for (auto& pool : pools) {
+			bytes += pool.first->bytes() - pool.second;
 		}
+		return bytes;
+	}
 
-		sym.sortConstants();
-
-		// Symmetric closure of wire conflicts
-		for (int i = 0; i < sym.wire_count; i++) {
-			wire_mask_t mask = wire_conflicts[i];
-			for (int j = 0; j < sym.wire_count; j++) {
-				if (mask & ((wire_mask_t)1 << j)) {
-					wire_conflicts[j] |= (wire_mask_t)1 << i;
+	void startThreads() {
+		for (int i = 1; i < n_threads; i++) {
+			threads.emplace_back([this, i]() {
+				addPool();
+				int seen = 0;
+				while (true) {
+					{
+						std::unique_lock<std::mutex> lock(mutex);
+						wake.wait(lock, [&]() { return quit || generation != seen; });
+						if (quit) return;
+						seen = generation;
+					}
+					work(i);
+					{
+						std::lock_guard<std::mutex> lock(mutex);
+						if (--busy == 0) done.notify_one();
+					}
+				}
+			});
+		}
+	}
+
+	void stopThreads() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		wake.notify_all();
+		for (std::thread& thread : threads) {
+			thread.join();
+		}
+		threads.clear();
+		quit = false;
+		// The pools of the workers are gone with them
+		pools.resize(std::min<size_t>(pools.size(), 1));
+	}
+
+	void work(int index) {
+		TurtleRunner& runner = *runners[index];
+		bool batch = use_batch && !runner.jit_active() && !trace;
+		for (size_t c = next_chunk++; c < job_chunks; c = next_chunk++) {
+			TurtleEffects& chunk = effects[c];
+			chunk.clear();
+			runner.effects = &chunk;
+			size_t end = std::min(job_end, job_begin + (c + 1) * CHUNK_SIZE);
+			for (size_t i = job_begin + c * CHUNK_SIZE; i < end && !chunk.failed;) {
+				// Turtles at the same point of the program run together
+				size_t group = i + 1;
+				if (batch && (*job_list)[i].weight == 1) {
+					while (group < end && (*job_list)[group].pc == (*job_list)[i].pc && (*job_list)[group].weight == 1) group++;
+				}
+				if (group - i >= MIN_BATCH) {
+					batches[index]->run(&(*job_list)[i], group - i, chunk);
+					i = group;
+					continue;
+				}
+				for (; i < group; i++) {
+					try {
+						runner.runTurtle(std::move((*job_list)[i]));
+					} catch (const TurtleError& error) {
+						chunk.failed = true;
+						chunk.error = error;
+						break;
+					}
 				}
 			}
 		}
-
-		this->stats = nullptr;
-		return output;
 	}
 
-	std::vector<TintColor> get_colors(AProgram program) {
-		colors.clear();
-		time = MAKE_NUMBER(0);
-		current_palette.clear();
-		is_fading = false;
-		sym.traverse<APlanDecl>(program, [&](APlanDecl plan) {
-			process_color_events(plan.getEvent());
-		});
-		if (is_fading) do_fade();
-		return colors;
+	// Run the turtles in a range of a state list, then apply their effects
+	// in list order, so the result does not depend on the number of threads.
+	void runGeneration(StateList& list, size_t begin, size_t end) {
+		job_chunks = (end - begin + CHUNK_SIZE - 1) / CHUNK_SIZE;
+		if (effects.size() < job_chunks) effects.resize(job_chunks);
+		job_list = &list;
+		job_begin = begin;
+		job_end = end;
+		next_chunk = 0;
+		if (threads.empty() || job_chunks == 1) {
+			work(0);
+		} else {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				busy = threads.size();
+				generation++;
+			}
+			wake.notify_all();
+			work(0);
+			std::unique_lock<std::mutex> lock(mutex);
+			done.wait(lock, [&]() { return busy == 0; });
+		}
+		for (size_t c = 0; c < job_chunks; c++) {
+			apply(effects[c]);
+		}
 	}
 
-	bool get_form(AProgram program, int *width_out, int *height_out, int *count_out, int *depth_out) {
-		bool found = false;
-		sym.traverse<AFormDecl>(program, [&](AFormDecl form) {
-			short width = NUMBER_TO_INT(apply(form.getWidth()).number);
-			short height = NUMBER_TO_INT(apply(form.getHeight()).number);
-			short count = NUMBER_TO_INT(apply(form.getCount()).number);
-			short depth = NUMBER_TO_INT(apply(form.getDepth()).number);
-			if (count < 1) {
-				throw CompileException(form.getToken(), "Layer count must be at least 1");
+	void apply(TurtleEffects& chunk) {
+		output.insert(output.end(), chunk.plots.begin(), chunk.plots.end());
+		if (trace) {
+			for (State& turtle : chunk.scheduled) {
+				if (turtle.id == 0) turtle.id = next_turtle_id++;
 			}
-			if (depth < 1) {
-				throw CompileException(form.getToken(), "Layer depth must be at least 1");
+			for (TraceRecord& record : chunk.trace) {
+				if (record.kind == TraceKind::FORK) record.a = chunk.scheduled[record.a].id;
 			}
-			if (found) {
-				if (width != *width_out || height != *height_out || count != *count_out || depth != *depth_out) {
-					throw CompileException(form.getToken(), "This form declaration conflicts with an earlier one");
-				}
+			trace->write(chunk.trace);
+		}
+		for (State& turtle : chunk.scheduled) {
+			schedule(std::move(turtle));
+		}
+		for (auto& literal : chunk.literals) {
+			sym.registerConstant(code.literal_nodes[literal.first], literal.second);
+			if (literal.first < literal_frame.size() && literal_frame[literal.first] < 0) {
+				literal_frame[literal.first] = current_frame;
 			}
-			*width_out = width;
-			*height_out = height;
-			*count_out = count;
-			*depth_out = depth;
-			found = true;
-		});
-		return found;
+		}
+		for (auto& warning : chunk.warnings) {
+			rep.reportWarning(code.tokens[warning.first], warning.second);
+		}
+		if (chunk.failed) {
+			throw CompileException(code.tokens[chunk.error.pc], chunk.error.message);
+		}
 	}
 
-private:
-	// Count CPU cycles
-	void cpu(int cycles, int per_wire_cycles = 0) {
-		if (stats != nullptr) {
-			short f = NUMBER_TO_INT(state.time);
-			if (f >= 0 && f < stats->frames) {
-				stats->frame[f].cpu_compute_cycles += cycles;
-				stats->frame[f].per_wire_cycles += per_wire_cycles;
+	// Merge identical turtles in a range of a state list into the first of
+	// them, which gets their combined weight. Returns the new end of the list.
+	size_t coalesceTurtles(StateList& list, size_t begin) {
+		first_turtle.clear();
+		size_t end = begin;
+		for (size_t i = begin; i < list.size(); i++) {
+			uint64_t hash = list[i].hash();
+			auto found = first_turtle.find(hash);
+			if (found != first_turtle.end() && list[found->second].sameAs(list[i])) {
+				list[found->second].weight += list[i].weight;
+				stats->coalesced_turtles++;
+				continue;
 			}
+			if (found == first_turtle.end()) first_turtle.emplace(hash, end);
+			if (end != i) list[end] = std::move(list[i]);
+			end++;
+		}
+		live_turtles -= list.size() - end;
+		list.erase(list.begin() + end, list.end());
+		return end;
+	}
+
+	// Stop if the translation is cancelled or a limit is exceeded. The
+	// turtles of the current frame from index next on have not run yet.
+	void checkLimits(const StateList& list, size_t next) {
+		if (cancel && *cancel) {
+			throw TranslateCancelled();
+		}
+		char message[100];
+		if (max_turtles > 0 && live_turtles > max_turtles) {
+			snprintf(message, sizeof(message), "More than %ld turtles alive", max_turtles);
+		} else if (max_runs > 0 && runs > max_runs) {
+			snprintf(message, sizeof(message), "Turtles run more than %ld times", max_runs);
+		} else if (max_seconds > 0 && std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count() > max_seconds) {
+			snprintf(message, sizeof(message), "Interpretation took more than %g seconds", max_seconds);
+		} else if (max_memory > 0 && memoryInUse() > max_memory) {
+			snprintf(message, sizeof(message), "Turtles took more than %ld MB of memory", max_memory >> 20);
+		} else {
+			return;
 		}
-	}
 
-	// Util
-	int sin(int a) {
-		int na = a & 8191;
-		if (na == 4096) {
-			return a & 8192 ? -16384 : 16384;
+		// Blame the procedure with the most turtles still to run in this
+		// frame, or else with the most turtles waiting
+		std::vector<long> count(code.proc_entry.size());
+		for (size_t i = next; i < list.size(); i++) {
+			count[list[i].proc] += list[i].weight;
 		}
-		if (na > 4096) {
-			na = 8192 - na;
+		for (int f = current_frame + 1; next == list.size() && f < stats->frames; f++) {
+			for (const State& turtle : state_lists[f]) {
+				count[turtle.proc] += turtle.weight;
+			}
 		}
-		int na2 = (na * na) >> 8;
-		int r = (((((((2373 * na2) >> 16) - 21073) * na2) >> 16) + 51469) * na) >> 13;
-		return a & 8192 ? -r : r;
-	}
-
-	number_t random_iteration(number_t v) {
-		return ((v & 0xFFFF) * 0x9D3D) + ((v << 16) | ((v >> 16) & 0xFFFF));
+		int proc = std::max_element(count.begin(), count.end()) - count.begin();
+		throw CompileException(sym.procs[proc].getName(),
+			std::string(message) + " at frame " + std::to_string(current_frame));
 	}
 
-	// Expressions
-
-	void caseABinaryExpression(ABinaryExpression exp) override {
-		Value left = apply(exp.getLeft());
-		Value right = apply(exp.getRight());
-		std::function<number_t(number_t,number_t)> eval;
-		Token token;
-		PBinop op = exp.getOp();
-		cpu(20);
-		if (op.is<APlusBinop>()) {
-			token = op.cast<APlusBinop>().getPlus();
-			eval = [&](number_t a, number_t b) { return a + b; };
-		} else if (op.is<AMinusBinop>()) {
-			token = op.cast<AMinusBinop>().getMinus();
-			eval = [&](number_t a, number_t b) { return a - b; };
-		} else if (op.is<AMultiplyBinop>()) {
-			token = op.cast<AMultiplyBinop>().getMul();
-			eval = [&](number_t a, number_t b) {
-				if (a >= (128 << 16) || a < -(128 << 16)) {
-					rep.reportWarning(token, "Left operand overflows");
-				}
-				if (b >= (128 << 16) || b < -(128 << 16)) {
-					rep.reportWarning(token, "Right operand overflows");
-				}
-				return (a << 8 >> 16) * (b << 8 >> 16);
+	void schedule(State&& turtle) {
+		short f = NUMBER_TO_INT(turtle.time);
+		if (f >= 0 && f < stats->frames) {
+			proc_first_frame[turtle.proc] = std::min<int>(proc_first_frame[turtle.proc], f);
+			state_lists[f].push_back(std::move(turtle));
+			live_turtles++;
+		} else {
+			int overwait = f - stats->frames;
+			if (overwait > stats->max_overwait) stats->max_overwait = overwait;
+		}
+	}
+
+	// Evaluate an expression outside of procedures
+	Value evaluate(PExpression exp) {
+		if (!expression_entry.count(exp)) {
+			expression_entry[exp] = lowering.lowerExpression(exp);
+		}
+		TurtleEffects chunk;
+		runners[0]->effects = &chunk;
+		Value result;
+		try {
+			result = runners[0]->evaluate(expression_entry[exp]);
+		} catch (const TurtleError& error) {
+			chunk.failed = true;
+			chunk.error = error;
+		}
+		apply(chunk);
+		return result;
+	}
+
+	// Hash of the code of each procedure, independent of where the procedure
+	// and its literals are placed. Also finds the literals of each procedure.
+	std::vector<uint64_t> procedureHashes(int code_end, int literals) {
+		std::vector<uint64_t> hashes;
+		proc_literals.clear();
+		literal_value.assign(code.literal_nodes.size(), 0);
+		for (int p = 0; p < code.proc_entry.size(); p++) {
+			int entry = code.proc_entry[p];
+			int end = p + 1 < code.proc_entry.size() ? code.proc_entry[p + 1] : code_end;
+			proc_literals.push_back(literals);
+			uint64_t hash = 14695981039346656037ULL;
+			auto mix = [&](uint64_t value) {
+				hash = (hash ^ value) * 1099511628211ULL;
 			};
-			cpu(126 - 20);
-		} else if (op.is<ADivideBinop>()) {
-			token = op.cast<ADivideBinop>().getDiv();
-			eval = [&](number_t a, number_t b) {
-				if (b >= (128 << 16) || b < -(128 << 16)) {
-					rep.reportWarning(token, "Right operand overflows");
-				}
-				int divisor = b << 8 >> 16;
-				if (divisor == 0) {
-					throw CompileException(token, "Division by zero");
+			for (int pc = entry; pc < end; pc++) {
+				Instruction ins = code.code[pc];
+				switch (ins.op) {
+				case Op::COND:
+				case Op::WHEN:
+				case Op::JUMP:
+					ins.a -= entry;
+					break;
+				case Op::LITERAL:
+					literal_value[ins.b] = ins.a;
+					ins.b -= proc_literals[p];
+					literals++;
+					break;
+				case Op::ERROR:
+					ins.a = std::hash<std::string>()(code.messages[ins.a]);
+					break;
+				default:
+					break;
 				}
-				int div_result = a / divisor;
-				if (b >= (128 << 16) || b < -(128 << 16)) {
-					rep.reportWarning(token, "Result overflows");
-				}
-				return div_result << 8;
-			};
-			cpu(218 - 20);
-		} else if (op.is<AAslBinop>()) {
-			token = op.cast<AAslBinop>().getAsl();
-			eval = [&](number_t a, number_t b) {
-				int shift = (b >> 16) & 63;
-				cpu(shift * 2);
-				if (shift >= 32) return 0;
-				return a << shift;
-			};
-		} else if (op.is<AAsrBinop>()) {
-			token = op.cast<AAsrBinop>().getAsr();
-			eval = [&](number_t a, number_t b) {
-				int shift = (b >> 16) & 63;
-				cpu(shift * 2);
-				if (shift >= 32) return -1;
-				return a >> shift;
-			};
-		} else if (op.is<ALsrBinop>()) {
-			token = op.cast<ALsrBinop>().getLsr();
-			eval = [&](number_t a, number_t b) {
-				int shift = (b >> 16) & 63;
-				cpu(shift * 2);
-				if (shift >= 32) return 0;
-				return (number_t)((unsigned)a >> shift);
-			};
-		} else if (op.is<ARolBinop>()) {
-			token = op.cast<ARolBinop>().getRol();
-			eval = [&](number_t a, number_t b) {
-				int shift = (b >> 16) & 31;
-				cpu(shift * 2);
-				if (shift == 0) return a;
-				return (number_t)((a << shift) | ((unsigned)a >> (32 - shift)));
-			};
-		} else if (op.is<ARorBinop>()) {
-			token = op.cast<ARorBinop>().getRor();
-			eval = [&](number_t a, number_t b) {
-				int shift = (b >> 16) & 31;
-				cpu(shift * 2);
-				if (shift == 0) return a;
-				return (number_t)(((unsigned)a >> shift) | (a << (32 - shift)));
-			};
-		} else if (op.is<AEqBinop>()) {
-			token = op.cast<AEqBinop>().getEq();
-			eval = [&](number_t a, number_t b) { return a == b ? MAKE_NUMBER(1) : MAKE_NUMBER(0); };
-		} else if (op.is<ANeBinop>()) {
-			token = op.cast<ANeBinop>().getNe();
-			eval = [&](number_t a, number_t b) { return a != b ? MAKE_NUMBER(1) : MAKE_NUMBER(0); };
-		} else if (op.is<ALtBinop>()) {
-			token = op.cast<ALtBinop>().getLt();
-			eval = [&](number_t a, number_t b) { return a < b ? MAKE_NUMBER(1) : MAKE_NUMBER(0); };
-		} else if (op.is<ALeBinop>()) {
-			token = op.cast<ALeBinop>().getLe();
-			eval = [&](number_t a, number_t b) { return a <= b ? MAKE_NUMBER(1) : MAKE_NUMBER(0); };
-		} else if (op.is<AGtBinop>()) {
-			token = op.cast<AGtBinop>().getGt();
-			eval = [&](number_t a, number_t b) { return a > b ? MAKE_NUMBER(1) : MAKE_NUMBER(0); };
-		} else if (op.is<AGeBinop>()) {
-			token = op.cast<AGeBinop>().getGe();
-			eval = [&](number_t a, number_t b) { return a >= b ? MAKE_NUMBER(1) : MAKE_NUMBER(0); };
-		} else if (op.is<AAndBinop>()) {
-			token = op.cast<AAndBinop>().getAnd();
-			eval = [&](number_t a, number_t b) { return a & b; };
-		} else if (op.is<AOrBinop>()) {
-			token = op.cast<AOrBinop>().getOr();
-			eval = [&](number_t a, number_t b) { return a | b; };
-		}
-
-		if (left.kind != ValueKind::NUMBER) {
-			throw CompileException(token, "Left side of operation is not a number");
-		}
-		if (right.kind != ValueKind::NUMBER) {
-			throw CompileException(token, "Right side of operation is not a number");
-		}
-
-		result = Value(eval(left.number, right.number));
+				mix((int)ins.op);
+				mix((unsigned)ins.a);
+				mix((unsigned)ins.b);
+			}
+			hashes.push_back(hash);
+		}
+		return hashes;
 	}
 
-	void caseANegExpression(ANegExpression exp) override {
-		Value inner = apply(exp.getExpression());
-		if (inner.kind != ValueKind::NUMBER) {
-			throw CompileException(exp.getToken(), "Operand of negation is not a number");
+	static void addCounts(std::vector<int64_t>& sum, const std::vector<int64_t>& counts) {
+		for (size_t i = 0; i < sum.size(); i++) {
+			sum[i] += counts[i];
 		}
-		result = Value(-inner.number);
-		cpu(4);
 	}
 
-	void caseASineExpression(ASineExpression exp) override {
-		Value inner = apply(exp.getExpression());
-		if (inner.kind != ValueKind::NUMBER) {
-			throw CompileException(exp.getToken(), "Operand of sine is not a number");
+	// Execution counts of the previous interpretation, moved to the new
+	// positions of the procedures. Changed procedures had not run yet.
+	std::vector<int64_t> moveCounts(const std::vector<int64_t>& old_counts, const InterpretRecord& record,
+			const std::vector<uint64_t>& hashes, int code_end) {
+		std::vector<int64_t> moved(code_end);
+		for (int p = 0; p < hashes.size(); p++) {
+			if (hashes[p] != record.proc_hash[p]) continue;
+			int entry = code.proc_entry[p];
+			int length = (p + 1 < hashes.size() ? code.proc_entry[p + 1] : code_end) - entry;
+			auto old_entry = old_counts.begin() + record.proc_entry[p];
+			std::copy(old_entry, old_entry + length, moved.begin() + entry);
 		}
-		result = Value(sin((inner.number & 0xffff) >> 2) << 2);
-		cpu(42);
+		return moved;
 	}
 
-	void caseARandExpression(ARandExpression exp) override {
-		state.seed = random_iteration(state.seed);
-		result = Value((state.seed >> 16) & 0xFFFF);
-		cpu(12 + 144);
-	}
+	// Continue from the previous interpretation, up to the first frame where
+	// a changed procedure ran. Returns the frame to continue from, or -1.
+	int resume(InterpretRecord& record, const std::vector<uint64_t>& hashes, int end, int code_end) {
+		bool same_shape = record.valid &&
+			record.frames == stats->frames && record.width == stats->width && record.height == stats->height &&
+			record.layer_count == stats->layer_count && record.layer_depth == stats->layer_depth &&
+			record.wire_count == sym.wire_count && record.coalesce == coalesce &&
+			record.proc_names == code.proc_names && record.proc_params == code.proc_params;
+		record.valid = false;
+		if (!same_shape) {
+			record.checkpoints.clear();
+			return -1;
+		}
 
-	void caseAVarExpression(AVarExpression exp) override {
-		VarRef ref = sym.var_ref[exp];
-		switch (ref.kind) {
-		case VarKind::GLOBAL:
-			switch (static_cast<GlobalKind>(ref.index)) {
-			case GlobalKind::X:
-				result = Value(state.x);
-				break;
-			case GlobalKind::Y:
-				result = Value(state.y);
-				break;
-			case GlobalKind::DIRECTION:
-				result = Value(state.direction);
-				break;
+		int changed_frame = std::min(record.end, end);
+		for (int p = 0; p < hashes.size(); p++) {
+			if (hashes[p] != record.proc_hash[p]) {
+				changed_frame = std::min(changed_frame, record.proc_first_frame[p]);
 			}
-			break;
-		case VarKind::LOCAL:
-			if (state.stack.size() <= ref.index) {
-				throw CompileException(exp.getName(), "Internal error: Local index out of range");
+		}
+		int c = record.checkpoints.size() - 1;
+		while (record.checkpoints[c].frame > changed_frame) c--;
+		record.checkpoints.resize(c + 1);
+		InterpretRecord::Checkpoint& checkpoint = record.checkpoints[c];
+		int frame = checkpoint.frame;
+
+		// Output and statistics so far
+		output.assign(record.plots.begin(), record.plots.begin() + checkpoint.plots);
+		std::copy(record.stats.begin(), record.stats.begin() + frame, stats->frame.begin());
+		for (auto& pending : checkpoint.pending) {
+			stats->frame[pending.frame] = pending.stats;
+		}
+		stats->max_overwait = checkpoint.max_overwait;
+		wire_conflicts = checkpoint.wire_conflicts;
+
+		// Literals registered so far. Changed procedures did not run yet.
+		for (int p = 0; p < hashes.size(); p++) {
+			if (record.proc_first_frame[p] < frame) proc_first_frame[p] = record.proc_first_frame[p];
+			if (hashes[p] != record.proc_hash[p]) continue;
+			int old_end = p + 1 < hashes.size() ? record.proc_literals[p + 1] : record.literal_frame.size();
+			for (int old_slot = record.proc_literals[p]; old_slot < old_end; old_slot++) {
+				int literal_frame_old = record.literal_frame[old_slot];
+				if (literal_frame_old >= 0 && literal_frame_old < frame) {
+					int slot = proc_literals[p] + old_slot - record.proc_literals[p];
+					sym.registerConstant(code.literal_nodes[slot], literal_value[slot]);
+					literal_frame[slot] = literal_frame_old;
+					for (auto& runner : runners) {
+						runner->seeLiteral(slot);
+					}
+				}
+			}
+		}
+
+		// Turtles, moved to the new positions of their procedures. Checkpoints
+		// up to this one are kept for later and moved likewise.
+		for (InterpretRecord::Checkpoint& kept : record.checkpoints) {
+			for (auto& pending : kept.pending) {
+				for (State& turtle : pending.turtles) {
+					turtle.pc += code.proc_entry[turtle.proc] - record.proc_entry[turtle.proc];
+				}
 			}
-			result = state.stack[ref.index];
-			break;
-		case VarKind::WIRE:
-			if ((state.wires_set & ((wire_mask_t)1 << ref.index)) == 0) {
-				throw CompileException(exp.getName(), "Uninitialized wire");
+			kept.counts = moveCounts(kept.counts, record, hashes, code_end);
+		}
+		counts = checkpoint.counts;
+		for (auto& pending : checkpoint.pending) {
+			for (State& turtle : pending.turtles) {
+				proc_first_frame[turtle.proc] = std::min(proc_first_frame[turtle.proc], pending.frame);
 			}
-			result = state.wire_values[ref.index];
-			wire_conflicts[ref.index] |= state.wires_written_since[ref.index];
-			break;
-		case VarKind::FACT:
-			if (ref.index >= sym.fact_values.size()) {
-				throw CompileException(exp.getName(), "Facts can only refer to earlier facts");
+			state_lists[pending.frame] = pending.turtles;
+			live_turtles += pending.turtles.size();
+		}
+		return frame;
+	}
+
+	void takeCheckpoint(InterpretRecord& record, int frame) {
+		if (!record.checkpoints.empty() && record.checkpoints.back().frame >= frame) return;
+		record.checkpoints.emplace_back();
+		InterpretRecord::Checkpoint& checkpoint = record.checkpoints.back();
+		checkpoint.frame = frame;
+		checkpoint.plots = output.size();
+		checkpoint.max_overwait = stats->max_overwait;
+		checkpoint.wire_conflicts = wire_conflicts;
+		checkpoint.counts = counts;
+		for (auto& runner : runners) {
+			checkpoint.wire_conflicts.merge(runner->wire_conflicts);
+			addCounts(checkpoint.counts, runner->counts);
+		}
+		for (int f = frame; f < stats->frames; f++) {
+			FrameStatistics frame_stats = stats->frame[f];
+			for (auto& runner : runners) {
+				frame_stats.add(runner->statistics().frame[f]);
 			}
-			result = Value(sym.fact_values[ref.index]);
-			if (procedure_phase) {
-				sym.registerConstant(exp, result.number);
+			if (!frame_stats.empty() || !state_lists[f].empty()) {
+				checkpoint.pending.push_back({f, frame_stats, state_lists[f]});
 			}
-			break;
-		case VarKind::PROCEDURE:
-			result = Value(sym.procs[ref.index], true);
-			break;
 		}
-		cpu(12 + 16);
 	}
 
-	void caseANumberExpression(ANumberExpression exp) override {
-		result = Value(sym.literal_number[exp]);
-		if (procedure_phase) {
-			sym.registerConstant(exp, result.number);
-		}
-		cpu(12 + 16);
+	// Merge statistics, wire conflicts and execution counts of all runners
+	void mergeRunners() {
+		for (auto& runner : runners) {
+			const RoseStatistics& runner_stats = runner->statistics();
+			for (int f = 0; f < stats->frames; f++) {
+				stats->frame[f].add(runner_stats.frame[f]);
+			}
+			wire_conflicts.merge(runner->wire_conflicts);
+			addCounts(counts, runner->counts);
+		}
+	}
+
+	void saveRecord(InterpretRecord& record, const std::vector<uint64_t>& hashes, int end) {
+		record.frames = stats->frames;
+		record.width = stats->width;
+		record.height = stats->height;
+		record.layer_count = stats->layer_count;
+		record.layer_depth = stats->layer_depth;
+		record.wire_count = sym.wire_count;
+		record.coalesce = coalesce;
+		record.proc_names = code.proc_names;
+		record.proc_params = code.proc_params;
+		record.proc_hash = hashes;
+		record.proc_entry = code.proc_entry;
+		record.proc_literals = proc_literals;
+		record.proc_first_frame = proc_first_frame;
+		record.literal_frame = literal_frame;
+		record.plots = output;
+		record.stats = stats->frame;
+		record.end = end;
+		record.valid = true;
 	}
 
-	void caseACondExpression(ACondExpression exp) override {
-		Value cond = apply(exp.getCond());
-		if (cond.kind != ValueKind::NUMBER) {
-			throw CompileException(exp.getToken(), "Condition is not a number");
-		}
-		if (cond.number != 0) {
-			result = apply(exp.getWhen());
-			cpu(12 + 10);
-		} else {
-			result = apply(exp.getElse());
-			cpu(10);
-		}
-	}
+public:
+	WireConflicts wire_conflicts;
 
-	// Statements
+	// First frame that was interpreted rather than reused from the record
+	int resumed_frame = 0;
 
-	void caseAWhenStatement(AWhenStatement s) override {
-		Value cond = apply(s.getCond());
-		if (cond.kind != ValueKind::NUMBER) {
-			throw CompileException(s.getToken(), "Condition is not a number");
-		}
-		if (cond.number != 0) {
-			s.getWhen().apply(*this);
-			state.stack.resize(state.stack.size() - sym.when_pop[s]);
-			cpu(12 + 10);
-			if (sym.when_pop[s] != 0) cpu(8);
-		} else {
-			s.getElse().apply(*this);
-			state.stack.resize(state.stack.size() - sym.else_pop[s]);
-			cpu(10);
-			if (sym.else_pop[s] != 0) cpu(8);
+	Interpreter(Reporter& rep, SymbolLinking& sym, const TranslateOptions& options = TranslateOptions())
+		: rep(rep), sym(sym), stats(nullptr), lowering(sym, code), use_jit(options.jit), use_batch(options.batch), coalesce(options.coalesce), stop_frame(options.stop_frame),
+		  n_threads(std::max(options.threads, 1)), fact_overrides(options.facts), trace_file(options.trace_file),
+		  max_turtles(options.max_turtles), max_runs(options.max_runs), max_seconds(options.max_seconds),
+		  max_memory(options.max_memory), cancel(options.cancel), wire_conflicts(sym.wire_count) {
+		for (int i = 0; i < n_threads; i++) {
+			runners.emplace_back(new TurtleRunner(code, sym));
+			batches.emplace_back(new TurtleBatch(*runners[i], code));
 		}
 	}
 
-	void caseAForkStatement(AForkStatement s) override {
-		Value proc = apply(s.getProc());
-		if (proc.kind != ValueKind::PROCEDURE) {
-			throw CompileException(s.getToken(), "Target is not a procedure");
-		}
-		int n_args = s.getArgs().size();
-		int n_params = proc.proc.getParams().size();
-		if (n_args != n_params) {
-			throw CompileException(s.getToken(), "Wrong number of arguments for procedure " + proc.proc.getName().getText() + ": "
-				+ std::to_string(n_args) + " given, " + std::to_string(n_params) + " expected");
-		}
-		std::vector<Value> args;
-		for (auto a : s.getArgs()) {
-			args.push_back(apply(a));
-		}
-		pending.emplace(proc.proc, state, std::move(args));
-		forked_in_frame = true;
-		if (proc.proc == state.proc) {
-			// Assume tail fork. Negate dispatch overhead.
-			cpu(20 + n_args * 28 - 140);
-		} else {
-			cpu(344 + n_args * 34, 20);
-		}
+	~Interpreter() {
+		stopThreads();
 	}
 
-	void caseATempStatement(ATempStatement s) override {
-		state.stack.push_back(apply(s.getExpression()));
+	bool jit_active() {
+		return runners[0]->jit_active();
 	}
 
-	void caseAWireStatement(AWireStatement s) override {
-		int index = sym.wire_index[s];
-		state.wire_values[index] = apply(s.getExpression());
-		state.wires_set |= (wire_mask_t)1 << index;
-		for (int i = 0; i < sym.wire_count; i++) {
-			state.wires_written_since[i] |= (wire_mask_t)1 << index;
+	void evaluate_facts(AProgram prog) {
+		sym.fact_values.clear();
+		std::vector<bool> used(fact_overrides.size());
+		sym.traverse<AFactDecl>(prog, [&](AFactDecl fact) {
+			for (int i = 0; i < fact_overrides.size(); i++) {
+				if (fact_overrides[i].name == fact.getName().getText()) {
+					sym.fact_values.push_back(fact_overrides[i].value);
+					used[i] = true;
+					return;
+				}
+			}
+			Value fact_value = evaluate(fact.getExpression());
+			sym.fact_values.push_back(fact_value.number);
+		});
+		for (int i = 0; i < fact_overrides.size(); i++) {
+			if (!used[i]) {
+				throw Exception("No fact named " + fact_overrides[i].name);
+			}
 		}
-		state.wires_written_since[index] = 0;
 	}
 
-	void caseAWaitStatement(AWaitStatement s) override {
-		Value wait = apply(s.getExpression());
-		if (wait.kind != ValueKind::NUMBER) {
-			throw CompileException(s.getToken(), "Wait value is not a number");
-		}
-		if (wait.number < 0) {
-			rep.reportWarning(s.getToken(), "Negative wait");
-			return;
+	std::vector<Plot> interpret(AProcDecl main, RoseStatistics *stats,
+			InterpretRecord *record = nullptr, TranslatePreview *preview = nullptr) {
+		long allocations_start, system_allocations_start;
+		BlockPool::counts(&allocations_start, &system_allocations_start);
+		pools.clear();
+		addPool();
+		start_time = std::chrono::steady_clock::now();
+		live_turtles = 0;
+		runs = 0;
+
+		int literals_start = code.literal_nodes.size();
+		lowering.lowerProcedures(sym.fact_values);
+		code.checked = TypeInference(code, sym.wire_count).run();
+		int code_end = code.code.size();
+		if (!trace_file.empty()) {
+			trace.reset(new TraceWriter(trace_file, code.proc_names, sym.wire_names));
+			if (!trace->valid()) {
+				trace.reset();
+				throw Exception("Could not write trace file " + trace_file);
+			}
+			// Frames reused from an earlier interpretation would be missing
+			record = nullptr;
 		}
-		int frame = NUMBER_TO_INT(state.time);
-		int new_frame = NUMBER_TO_INT(state.time + wait.number);
-		while (frame < stats->frames && frame < new_frame) {
-			stats->frame[frame++].turtles_survived++;
-			forked_in_frame = false;
+		for (auto& runner : runners) {
+			runner->start(*stats, use_jit && !trace, trace != nullptr);
 		}
-		state.time += wait.number;
-		cpu(146);
-	}
+		int main_index = std::find(sym.procs.begin(), sym.procs.end(), main) - sym.procs.begin();
 
-	void caseATurnStatement(ATurnStatement s) override {
-		Value turn = apply(s.getExpression());
-		if (turn.kind != ValueKind::NUMBER) {
-			throw CompileException(s.getToken(), "Turn value is not a number");
-		}
-		state.direction += turn.number;
-		cpu(12 + 16 + 20 + 16);
-	}
+		State initial;
+		initial.proc = main_index;
+		initial.pc = code.proc_entry[main_index];
+		initial.time = MAKE_NUMBER(0);
+		initial.x = MAKE_NUMBER(0);
+		initial.y = MAKE_NUMBER(0);
+		initial.size = MAKE_NUMBER(2);
+		initial.direction = MAKE_NUMBER(0);
+		initial.tint = MAKE_NUMBER(1);
+		initial.seed = 0xBABEFEED;
+		initial.wires = WireData::make(sym.wire_count);
+		initial.id = 1;
+		next_turtle_id = 2;
 
-	void caseAFaceStatement(AFaceStatement s) override {
-		Value face = apply(s.getExpression());
-		if (face.kind != ValueKind::NUMBER) {
-			throw CompileException(s.getToken(), "Face value is not a number");
+		this->stats = stats;
+		state_lists.clear();
+		state_lists.resize(stats->frames);
+		proc_first_frame.assign(code.proc_entry.size(), INT_MAX);
+		literal_frame.assign(code.literal_nodes.size(), -1);
+		counts.assign(code_end, 0);
+		int end = stop_frame > 0 ? std::min(stop_frame, stats->frames) : stats->frames;
+		std::vector<uint64_t> hashes;
+		resumed_frame = -1;
+		if (record) {
+			hashes = procedureHashes(code_end, literals_start);
+			resumed_frame = resume(*record, hashes, end, code_end);
+		}
+		if (resumed_frame < 0) {
+			resumed_frame = 0;
+			current_frame = 0;
+			schedule(std::move(initial));
+		}
+		startThreads();
+		if (preview) {
+			preview->publish(output, resumed_frame);
+		}
+		int f = resumed_frame;
+		try {
+			for (; f < end; f++) {
+				current_frame = f;
+				if (record && f % InterpretRecord::CHECKPOINT_INTERVAL == 0) {
+					takeCheckpoint(*record, f);
+				}
+				StateList& list = state_lists[f];
+				size_t frame_plots = output.size();
+				for (size_t begin = 0; begin < list.size();) {
+					size_t end = coalesce ? coalesceTurtles(list, begin) : list.size();
+					runGeneration(list, begin, end);
+					live_turtles -= end - begin;
+					runs += end - begin;
+					checkLimits(list, end);
+					begin = end;
+				}
+				StateList().swap(list);
+				sortFramePlots(output.begin() + frame_plots, output.end());
+				if (preview && (f + 1) % TranslatePreview::INTERVAL == 0) {
+					preview->publish(output, f + 1);
+				}
+			}
+		} catch (...) {
+			// Keep the frames before this one for the next run
+			stopThreads();
+			trace.reset();
+			if (record) {
+				mergeRunners();
+				saveRecord(*record, hashes, f);
+			}
+			this->stats = nullptr;
+			throw;
 		}
-		state.direction = face.number;
-		cpu(16);
-	}
-
-	void caseASizeStatement(ASizeStatement s) override {
-		Value size = apply(s.getExpression());
-		if (size.kind != ValueKind::NUMBER) {
-			throw CompileException(s.getToken(), "Size is not a number");
+		stopThreads();
+		trace.reset();
+		if (record) {
+			takeCheckpoint(*record, end);
 		}
-		state.size = size.number;
-		cpu(16);
-	}
+		long allocations, system_allocations;
+		BlockPool::counts(&allocations, &system_allocations);
+		stats->turtle_allocations = allocations - allocations_start;
+		stats->system_allocations = system_allocations - system_allocations_start;
 
-	void caseATintStatement(ATintStatement s) override {
-		Value tint = apply(s.getExpression());
-		if (tint.kind != ValueKind::NUMBER) {
-			throw CompileException(s.getToken(), "Tint is not a number");
+		mergeRunners();
+		if (record) {
+			saveRecord(*record, hashes, end);
 		}
-		state.tint = tint.number;
-		cpu(16);
-		short tint_int = NUMBER_TO_INT(tint.number);
-		if (tint_int < 0) {
-			rep.reportWarning(s.getToken(), "Negative tint");
-		} else if (tint_int >= stats->layer_count * stats->layer_depth) {
-			rep.reportWarning(s.getToken(), "Tint value outside range");
-		}
-	}
 
-	void caseASeedStatement(ASeedStatement s) override {
-		Value seed = apply(s.getExpression());
-		if (seed.kind != ValueKind::NUMBER) {
-			throw CompileException(s.getToken(), "Seed is not a number");
-		}
-		state.seed = random_iteration(random_iteration(seed.number));
-		cpu(204);
-	}
+		sym.sortConstants();
 
-	void caseAMoveStatement(AMoveStatement s) override {
-		Value move = apply(s.getExpression());
-		if (move.kind != ValueKind::NUMBER) {
-			throw CompileException(s.getToken(), "Move distance is not a number");
-		}
-		number_t m = move.number;
-		int sa = sin(state.direction >> 10);
-		int ca = sin((state.direction >> 10) + 4096);
-		if (m < MAKE_NUMBER(32) && m > -MAKE_NUMBER(32)) {
-			// High precision move
-			state.x += ((m << 10 >> 16) * ca) >> 8;
-			state.y += ((m << 10 >> 16) * sa) >> 8;
-			cpu(424);
-		} else {
-			// High distance move
-			state.x += (m << 2 >> 16) * ca;
-			state.y += (m << 2 >> 16) * sa;
-			cpu(m >= MAKE_NUMBER(32) ? 348 : 366);
-		}
-	}
+		wire_conflicts.makeSymmetric();
 
-	void caseAJumpStatement(AJumpStatement s) override {
-		Value x = apply(s.getX());
-		Value y = apply(s.getY());
-		if (x.kind != ValueKind::NUMBER) {
-			throw CompileException(s.getToken(), "X is not a number");
-		}
-		if (y.kind != ValueKind::NUMBER) {
-			throw CompileException(s.getToken(), "Y is not a number");
-		}
-		state.x = x.number;
-		state.y = y.number;
-		cpu(32);
+		this->stats = nullptr;
+		return output;
 	}
 
-	void draw(short tint) {
-		short f = NUMBER_TO_INT(state.time);
-		if (f >= 0 && f < stats->frames) {
-			short x = NUMBER_TO_INT(state.x);
-			short y = NUMBER_TO_INT(state.y);
-			short size = NUMBER_TO_INT(state.size);
-			output.push_back({f, x, y, size, tint});
-			stats->draw(f, x, y, size);
+	// How often procedures and branches ran in the last interpretation
+	Profile profile() {
+		Profile profile;
+		for (int entry : code.proc_entry) {
+			profile.runs.push_back(counts[entry]);
+		}
+		for (auto& ends : code.branch_ends) {
+			profile.when_runs[ends.when] = counts[ends.when_done];
+			profile.else_runs[ends.when] = counts[ends.else_done];
 		}
+		return profile;
 	}
 
-	void caseADrawStatement(ADrawStatement s) override {
-		draw(NUMBER_TO_INT(state.tint));
+	std::vector<TintColor> get_colors(AProgram program) {
+		colors.clear();
+		time = MAKE_NUMBER(0);
+		current_palette.clear();
+		is_fading = false;
+		sym.traverse<APlanDecl>(program, [&](APlanDecl plan) {
+			process_color_events(plan.getEvent());
+		});
+		if (is_fading) do_fade();
+		return colors;
 	}
 
-	void caseAPlotStatement(APlotStatement s) override {
-		draw(~NUMBER_TO_INT(state.tint));
+	bool get_form(AProgram program, int *width_out, int *height_out, int *count_out, int *depth_out) {
+		bool found = false;
+		sym.traverse<AFormDecl>(program, [&](AFormDecl form) {
+			short width = NUMBER_TO_INT(evaluate(form.getWidth()).number);
+			short height = NUMBER_TO_INT(evaluate(form.getHeight()).number);
+			short count = NUMBER_TO_INT(evaluate(form.getCount()).number);
+			short depth = NUMBER_TO_INT(evaluate(form.getDepth()).number);
+			if (count < 1) {
+				throw CompileException(form.getToken(), "Layer count must be at least 1");
+			}
+			if (depth < 1) {
+				throw CompileException(form.getToken(), "Layer depth must be at least 1");
+			}
+			if (found) {
+				if (width != *width_out || height != *height_out || count != *count_out || depth != *depth_out) {
+					throw CompileException(form.getToken(), "This form declaration conflicts with an earlier one");
+				}
+			}
+			*width_out = width;
+			*height_out = height;
+			*count_out = count;
+			*depth_out = depth;
+			found = true;
+		});
+		return found;
 	}
 
 };
@@ -0,0 +1,490 @@
+#pragma once
+
+#include "rose_result.h"
+#include "threaded_code.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define ROSE_JIT 1
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+// What the native code needs from the interpreter
+struct NativeRuntime {
+	void *context;
+	// Execute a single instruction. Returns 1 on error and 2 when the
+	// turtle is suspended.
+	int (*step)(void *context, Value *sp, int pc);
+	// Register a literal constant on first use
+	void (*literal)(void *context, int slot, number_t value);
+	char *literal_seen;
+	FrameStatistics **frame_stats;
+	// Execution counts per instruction
+	int64_t *counts;
+	// Turtle state, as offsets from the state base
+	char *state;
+	int x, y, size, direction, weight;
+};
+
+// Translation of the procedure code of a ThreadedCode into x86-64 machine code.
+// Simple instructions are compiled inline, operating directly on the value
+// stack at the statically known stack height. Everything else calls back
+// into the interpreter to execute that single instruction, so the semantics
+// are shared. Errors are never thrown through native code: the runtime
+// records them and the native code returns the status of the instruction.
+class NativeCode {
+	enum Reg {
+		RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+		R8 = 8, R9 = 9, R10 = 10, R11 = 11, R12 = 12, R13 = 13, R14 = 14, R15 = 15
+	};
+
+	enum Cond {
+		CC_E = 0x4, CC_NE = 0x5, CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF
+	};
+
+#ifdef _WIN32
+	static const int ARG0 = RCX, ARG1 = RDX, ARG2 = R8;
+#else
+	static const int ARG0 = RDI, ARG1 = RSI, ARG2 = RDX;
+#endif
+
+	// Register assignment inside procedure code
+	static const int CONTEXT = R12, STATE = R13, FRAME_STATS = R14, STACK = R15, LITERALS = RBX;
+
+	const ThreadedCode& code;
+	NativeRuntime runtime;
+
+	std::vector<unsigned char> buf;
+	std::vector<int> labels;
+	std::vector<std::pair<int, int>> fixups;
+	int begin;
+	unsigned char *memory = nullptr;
+	size_t memory_size = 0;
+
+	// Cycles not yet added to the frame statistics
+	int pending = 0;
+
+	struct Stub {
+		int label;
+		int pc;
+	};
+	std::vector<Stub> stubs;
+
+	// Emission
+
+	void byte(int b) {
+		buf.push_back(b);
+	}
+
+	void dword(int32_t d) {
+		for (int i = 0; i < 4; i++) byte((d >> (i * 8)) & 0xFF);
+	}
+
+	void qword(uint64_t q) {
+		for (int i = 0; i < 8; i++) byte((q >> (i * 8)) & 0xFF);
+	}
+
+	void rex(bool w, int reg, int base) {
+		int r = 0x40 | (w ? 8 : 0) | (reg & 8 ? 4 : 0) | (base & 8 ? 1 : 0);
+		if (r != 0x40) byte(r);
+	}
+
+	// Instruction with a [base + disp32] operand
+	void mem(std::initializer_list<int> opcode, int reg, int base, int32_t disp, bool w = false) {
+		rex(w, reg, base);
+		for (int b : opcode) byte(b);
+		byte(0x80 | ((reg & 7) << 3) | (base & 7));
+		if ((base & 7) == RSP) byte(0x24);
+		dword(disp);
+	}
+
+	// Instruction with a register operand
+	void reg(std::initializer_list<int> opcode, int reg, int rm, bool w = false) {
+		rex(w, reg, rm);
+		for (int b : opcode) byte(b);
+		byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+	}
+
+	void mov_imm(int r, int32_t imm) {
+		rex(false, 0, r);
+		byte(0xB8 + (r & 7));
+		dword(imm);
+	}
+
+	void mov_imm64(int r, const void *imm) {
+		rex(true, 0, r);
+		byte(0xB8 + (r & 7));
+		qword((uint64_t)(uintptr_t)imm);
+	}
+
+	void push(int r) {
+		rex(false, 0, r);
+		byte(0x50 + (r & 7));
+	}
+
+	void pop(int r) {
+		rex(false, 0, r);
+		byte(0x58 + (r & 7));
+	}
+
+	int new_label() {
+		labels.push_back(-1);
+		return labels.size() - 1;
+	}
+
+	void bind(int label) {
+		labels[label] = buf.size();
+	}
+
+	void jump(int label) {
+		byte(0xE9);
+		fixups.emplace_back(buf.size(), label);
+		dword(0);
+	}
+
+	void jump(Cond cc, int label) {
+		byte(0x0F);
+		byte(0x80 + cc);
+		fixups.emplace_back(buf.size(), label);
+		dword(0);
+	}
+
+	void call(const void *function) {
+		mov_imm64(RAX, function);
+		reg({0xFF}, 2, RAX);
+	}
+
+	// Value stack slots
+	static int32_t kind(int slot) {
+		return slot * sizeof(Value) + offsetof(Value, kind);
+	}
+
+	static int32_t number(int slot) {
+		return slot * sizeof(Value) + offsetof(Value, number);
+	}
+
+	void store(int slot, ValueKind k, int32_t value) {
+		mem({0xC7}, 0, STACK, kind(slot));
+		dword((int32_t)k);
+		mem({0xC7}, 0, STACK, number(slot));
+		dword(value);
+	}
+
+	// Jump to the slow path if the slot does not hold a number
+	void check_number(int slot, int stub) {
+		if (!code.checked) return;
+		mem({0x83}, 7, STACK, kind(slot));
+		byte((int)ValueKind::NUMBER);
+		jump(CC_NE, stub);
+	}
+
+	void flush() {
+		if (pending == 0) return;
+		mem({0x8B}, RAX, FRAME_STATS, 0, true);
+		reg({0x85}, RAX, RAX, true);
+		byte(0x74);
+		byte(10);
+		mem({0x81}, 0, RAX, offsetof(FrameStatistics, cpu_compute_cycles));
+		dword(pending);
+		pending = 0;
+	}
+
+	// Add the weight of the turtle to the count of an instruction
+	void count(int pc) {
+		mem({0x63}, RAX, STATE, runtime.weight, true);
+		mov_imm64(RCX, &runtime.counts[pc]);
+		mem({0x01}, RAX, RCX, 0, true);
+	}
+
+	void call_step(int pc, int exit) {
+		reg({0x89}, CONTEXT, ARG0, true);
+		mem({0x8D}, ARG1, STACK, code.heights[pc] * sizeof(Value), true);
+		mov_imm(ARG2, pc);
+		call((const void *)runtime.step);
+		reg({0x85}, RAX, RAX);
+		jump(CC_NE, exit);
+	}
+
+	void compile(int end, int exit_ok, int exit) {
+		std::vector<bool> target(end - begin);
+		std::vector<int> extra(end - begin);
+		for (int pc = begin; pc < end; pc++) {
+			const Instruction& ins = code.code[pc];
+			if (ins.op == Op::COND || ins.op == Op::WHEN || ins.op == Op::JUMP) {
+				target[ins.a - begin] = true;
+				if (ins.op == Op::COND) extra[ins.a - begin] = 10;
+			}
+		}
+
+		for (int pc = begin; pc < end; pc++) {
+			const Instruction& ins = code.code[pc];
+			int h = code.heights[pc];
+			if (target[pc - begin]) flush();
+			bind(pc - begin);
+			pending += extra[pc - begin];
+			switch (ins.op) {
+			case Op::CONST:
+				store(h, ValueKind::NUMBER, ins.a);
+				pending += 12 + 16;
+				break;
+			case Op::LITERAL: {
+				int seen = new_label();
+				mem({0x80}, 7, LITERALS, ins.b);
+				byte(0);
+				jump(CC_NE, seen);
+				reg({0x89}, CONTEXT, ARG0, true);
+				mov_imm(ARG1, ins.b);
+				mov_imm(ARG2, ins.a);
+				call((const void *)runtime.literal);
+				bind(seen);
+				store(h, ValueKind::NUMBER, ins.a);
+				pending += 12 + 16;
+				break;
+			}
+			case Op::LOCAL:
+				mem({0x8B}, RAX, STACK, ins.a * sizeof(Value), true);
+				mem({0x89}, RAX, STACK, h * sizeof(Value), true);
+				pending += 12 + 16;
+				break;
+			case Op::X:
+			case Op::Y:
+			case Op::DIR: {
+				int field = ins.op == Op::X ? runtime.x : ins.op == Op::Y ? runtime.y : runtime.direction;
+				mem({0x8B}, RAX, STATE, field);
+				mem({0xC7}, 0, STACK, kind(h));
+				dword((int32_t)ValueKind::NUMBER);
+				mem({0x89}, RAX, STACK, number(h));
+				pending += 12 + 16;
+				break;
+			}
+			case Op::PROC:
+				store(h, ValueKind::PROCEDURE, ins.a);
+				pending += 12 + 16;
+				break;
+
+			case Op::ADD:
+			case Op::SUB:
+			case Op::AND:
+			case Op::OR:
+			case Op::EQ:
+			case Op::NE:
+			case Op::LT:
+			case Op::LE:
+			case Op::GT:
+			case Op::GE: {
+				int stub = new_label();
+				stubs.push_back({stub, pc});
+				check_number(h - 2, stub);
+				check_number(h - 1, stub);
+				mem({0x8B}, RAX, STACK, number(h - 2));
+				switch (ins.op) {
+				case Op::ADD: mem({0x03}, RAX, STACK, number(h - 1)); break;
+				case Op::SUB: mem({0x2B}, RAX, STACK, number(h - 1)); break;
+				case Op::AND: mem({0x23}, RAX, STACK, number(h - 1)); break;
+				case Op::OR: mem({0x0B}, RAX, STACK, number(h - 1)); break;
+				default: {
+					Cond cc = ins.op == Op::EQ ? CC_E : ins.op == Op::NE ? CC_NE : ins.op == Op::LT ? CC_L
+					        : ins.op == Op::LE ? CC_LE : ins.op == Op::GT ? CC_G : CC_GE;
+					mem({0x3B}, RAX, STACK, number(h - 1));
+					reg({0x0F, 0x90 + cc}, 0, RAX);
+					reg({0x0F, 0xB6}, RAX, RAX);
+					reg({0xC1}, 4, RAX);
+					byte(16);
+					break;
+				}
+				}
+				mem({0x89}, RAX, STACK, number(h - 2));
+				pending += 20;
+				break;
+			}
+			case Op::NEG: {
+				int stub = new_label();
+				stubs.push_back({stub, pc});
+				check_number(h - 1, stub);
+				mem({0xF7}, 3, STACK, number(h - 1));
+				pending += 4;
+				break;
+			}
+
+			case Op::COND:
+			case Op::WHEN: {
+				int stub = new_label();
+				stubs.push_back({stub, pc});
+				check_number(h - 1, stub);
+				flush();
+				mem({0x83}, 7, STACK, number(h - 1));
+				byte(0);
+				jump(CC_E, ins.a - begin);
+				if (ins.op == Op::COND) pending += 12 + 10;
+				break;
+			}
+			case Op::WHEN_DONE:
+				pending += 12 + 10;
+				if (ins.a != 0) pending += 8;
+				count(pc);
+				break;
+			case Op::ELSE_DONE:
+				pending += 10;
+				if (ins.a != 0) pending += 8;
+				count(pc);
+				break;
+			case Op::JUMP:
+				flush();
+				jump(ins.a - begin);
+				break;
+			case Op::RETURN:
+			case Op::END:
+				flush();
+				jump(exit_ok);
+				break;
+
+			case Op::TURN:
+			case Op::FACE:
+			case Op::SIZE: {
+				int stub = new_label();
+				stubs.push_back({stub, pc});
+				check_number(h - 1, stub);
+				mem({0x8B}, RAX, STACK, number(h - 1));
+				if (ins.op == Op::TURN) {
+					mem({0x01}, RAX, STATE, runtime.direction);
+					pending += 12 + 16 + 20 + 16;
+				} else {
+					mem({0x89}, RAX, STATE, ins.op == Op::FACE ? runtime.direction : runtime.size);
+					pending += 16;
+				}
+				break;
+			}
+
+			case Op::WAIT:
+				// Changes the current frame
+				flush();
+				call_step(pc, exit);
+				break;
+			default:
+				call_step(pc, exit);
+				break;
+			}
+		}
+		flush();
+	}
+
+public:
+	static bool supported() {
+#ifdef ROSE_JIT
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	// Compile the procedure code, which starts at the first procedure entry
+	// and extends to the end of the code.
+	NativeCode(const ThreadedCode& code, const NativeRuntime& runtime) : code(code), runtime(runtime) {
+#ifdef ROSE_JIT
+		begin = code.proc_entry.empty() ? code.code.size() : code.proc_entry[0];
+		int end = code.code.size();
+		labels.resize(end - begin, -1);
+		int exit_ok = new_label();
+		int exit = new_label();
+
+		// Entry: (Value *stack, const void *target)
+		static const int saved[] = {
+			RBX, RBP, R12, R13, R14, R15,
+#ifdef _WIN32
+			RSI, RDI,
+#endif
+		};
+		int n_saved = sizeof(saved) / sizeof(saved[0]);
+		int frame = (n_saved % 2 == 0 ? 8 : 0);
+#ifdef _WIN32
+		frame += 32;
+#endif
+		for (int i = 0; i < n_saved; i++) push(saved[i]);
+		reg({0x81}, 5, RSP, true);
+		dword(frame);
+		reg({0x89}, ARG0, STACK, true);
+		mov_imm64(CONTEXT, runtime.context);
+		mov_imm64(STATE, runtime.state);
+		mov_imm64(FRAME_STATS, runtime.frame_stats);
+		mov_imm64(LITERALS, runtime.literal_seen);
+		reg({0xFF}, 4, ARG1, true);
+
+		bind(exit_ok);
+		reg({0x31}, RAX, RAX);
+		bind(exit);
+		reg({0x81}, 0, RSP, true);
+		dword(frame);
+		for (int i = n_saved - 1; i >= 0; i--) pop(saved[i]);
+		byte(0xC3);
+
+		compile(end, exit_ok, exit);
+
+		// Slow paths
+		for (const Stub& stub : stubs) {
+			bind(stub.label);
+			call_step(stub.pc, exit);
+			jump(exit);
+		}
+
+		for (auto& fixup : fixups) {
+			int32_t rel = labels[fixup.second] - (fixup.first + 4);
+			memcpy(&buf[fixup.first], &rel, 4);
+		}
+
+		memory_size = buf.size();
+#ifdef _WIN32
+		void *m = VirtualAlloc(nullptr, memory_size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (m == nullptr) return;
+		memcpy(m, buf.data(), memory_size);
+		DWORD old_protect;
+		if (!VirtualProtect(m, memory_size, PAGE_EXECUTE_READ, &old_protect)) {
+			VirtualFree(m, 0, MEM_RELEASE);
+			return;
+		}
+#else
+		void *m = mmap(nullptr, memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (m == MAP_FAILED) return;
+		memcpy(m, buf.data(), memory_size);
+		if (mprotect(m, memory_size, PROT_READ | PROT_EXEC) != 0) {
+			munmap(m, memory_size);
+			return;
+		}
+#endif
+		memory = (unsigned char *)m;
+#endif
+	}
+
+	~NativeCode() {
+#ifdef ROSE_JIT
+		if (memory == nullptr) return;
+#ifdef _WIN32
+		VirtualFree(memory, 0, MEM_RELEASE);
+#else
+		munmap(memory, memory_size);
+#endif
+#endif
+	}
+
+	NativeCode(const NativeCode&) = delete;
+	NativeCode& operator=(const NativeCode&) = delete;
+
+	bool valid() {
+		return memory != nullptr;
+	}
+
+	// Run procedure code from pc on the given stack, which holds the locals.
+	// Returns 0 at the end of the procedure, otherwise the status of the
+	// instruction that stopped it.
+	int run(int pc, Value *stack) {
+		typedef int (*Entry)(Value *stack, const void *target);
+		return ((Entry)memory)(stack, memory + labels[pc - begin]);
+	}
+};
@@ -4,8 +4,13 @@
 #include <GLFW/glfw3.h>
 
 #include <queue>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
 #include "translate.h"
 #include "renderer.h"
@@ -22,6 +27,9 @@
 #define FRAMES 10000
 #define FRAMERATE 50
 
+// Seconds between updates of the animation while it is being computed
+#define PREVIEW_INTERVAL 0.25
+
 
 void error_callback(int error, const char* description) {
 	printf(" *** GLFW error: %s\n", description);
@@ -68,13 +76,112 @@ public:
 	}
 };
 
+class Translation {
+	RoseResult result;
+	std::atomic<bool> done;
+	std::atomic<bool> cancelled;
+	std::thread thread;
+
+public:
+	TranslatePreview preview;
+
+	Translation(const char *filename, int frames, TranslateOptions options, TranslationCache *cache, bool retry)
+		: done(false), cancelled(false)
+	{
+		options.cancel = &cancelled;
+		thread = std::thread([=]() {
+			result = translate(filename, frames, WIDTH, HEIGHT, LAYERS, DEPTH, options, cache, &preview);
+			if (retry && result.empty() && !result.error && !cancelled) {
+				// Try again
+				usleep(100*1000);
+				result = translate(filename, frames, WIDTH, HEIGHT, LAYERS, DEPTH, options, cache, &preview);
+			}
+			fflush(stdout);
+			done = true;
+		});
+	}
+
+	bool finished() {
+		return done;
+	}
+
+	void cancel() {
+		cancelled = true;
+	}
+
+	RoseResult take() {
+		thread.join();
+		return std::move(result);
+	}
+
+	~Translation() {
+		if (thread.joinable()) thread.join();
+	}
+};
+
 int main(int argc, char *argv[]) {
-	if (argc < 2) {
-		printf("Usage: rose <filename> [<framerate> [<music>]]\n");
+	int arg = 1;
+	TranslateOptions options;
+	int first_frame = 0;
+	std::vector<FactSweep> fact_sweeps;
+	bool sweeping = false;
+	while (argc > arg && argv[arg][0] == '-') {
+		const char* option = argv[arg++];
+		if (strcmp(option, "-vm") == 0) {
+			options.engine = Engine::BYTECODE;
+		} else if (strcmp(option, "-compare") == 0) {
+			options.engine = Engine::COMPARE;
+		} else if (strcmp(option, "-jit") == 0) {
+			options.jit = true;
+		} else if (strcmp(option, "-threads") == 0 && argc > arg) {
+			options.threads = atoi(argv[arg++]);
+		} else if (strcmp(option, "-batch") == 0) {
+			options.batch = true;
+		} else if (strcmp(option, "-coalesce") == 0) {
+			options.coalesce = true;
+		} else if (strcmp(option, "-trace") == 0 && argc > arg) {
+			options.trace_file = argv[arg++];
+		} else if (strcmp(option, "-D") == 0 && argc > arg) {
+			FactSweep fact;
+			if (!parseFactSweep(argv[arg], &fact)) {
+				printf("Invalid fact values: %s\n", argv[arg]);
+				exit(1);
+			}
+			arg++;
+			if (fact.values.size() > 1) sweeping = true;
+			fact_sweeps.push_back(fact);
+		} else if (strcmp(option, "-range") == 0 && argc > arg + 1) {
+			first_frame = atoi(argv[arg++]);
+			options.stop_frame = atoi(argv[arg++]) + 1;
+		} else if (strcmp(option, "-merge") == 0 && argc > arg) {
+			options.merge_epsilon = (int)lround(atof(argv[arg++]) * 65536);
+		} else if (strcmp(option, "-maxturtles") == 0 && argc > arg) {
+			options.max_turtles = atol(argv[arg++]);
+		} else if (strcmp(option, "-maxruns") == 0 && argc > arg) {
+			options.max_runs = atol(argv[arg++]);
+		} else if (strcmp(option, "-maxtime") == 0 && argc > arg) {
+			options.max_seconds = atof(argv[arg++]);
+		} else if (strcmp(option, "-maxmemory") == 0 && argc > arg) {
+			options.max_memory = atol(argv[arg++]) << 20;
+		} else {
+			printf("Unknown option: %s\n", option);
+			exit(1);
+		}
+	}
+
+	if (argc <= arg) {
+		printf("Usage: rose [-vm | -compare] [-jit] [-threads <n>] [-batch] [-coalesce] [-trace <file>] [-D <fact>=<values>] [-range <first> <last>] [-merge <epsilon>] [-maxturtles <n>] [-maxruns <n>] [-maxtime <seconds>] [-maxmemory <MB>] <filename> [<framerate> [<music>]]\n");
+		exit(1);
+	}
+	if (options.stop_frame > 0 && options.engine != Engine::INTERPRETER) {
+		printf("The -range option only works with the interpreter\n");
+		exit(1);
+	}
+	if (options.coalesce && options.engine == Engine::COMPARE) {
+		printf("The -coalesce option does not work with -compare\n");
 		exit(1);
 	}
 
-	int arg = 1;
 	const char* main_filename = argv[arg++];
 
 	int window_scale = WINDOW_SCALE;
@@ -94,9 +201,35 @@ int main(int argc, char *argv[]) {
 		frames = (int) (player.length() * framerate);
 	}
 
-	// Load code
-	RoseResult rose_result = translate(main_filename, frames, WIDTH, HEIGHT, LAYERS, DEPTH);
-	std::unique_ptr<FileWatches> watches(new FileWatches(rose_result));
+	if (sweeping) {
+		sweep(main_filename, frames, WIDTH, HEIGHT, LAYERS, DEPTH, options, fact_sweeps);
+		return 0;
+	}
+	for (const FactSweep& fact : fact_sweeps) {
+		options.facts.push_back({fact.name, fact.values[0]});
+	}
+
+	int end_frame = frames;
+	if (options.stop_frame > 0 && options.stop_frame < frames) {
+		end_frame = options.stop_frame;
+	}
+
+	// Load code in the background and wait for the first frames
+	TranslationCache cache;
+	std::unique_ptr<Translation> translation(new Translation(main_filename, frames, options, &cache, false));
+	std::unique_ptr<FileWatches> watches;
+	RoseResult rose_result;
+	int horizon = 0;
+	while (!translation->preview.take(rose_result, &horizon)) {
+		if (translation->finished()) {
+			rose_result = translation->take();
+			translation.reset();
+			horizon = end_frame;
+			watches.reset(new FileWatches(rose_result));
+			break;
+		}
+		usleep(1000);
+	}
 	int width = rose_result.width;
 	int height = rose_result.height;
 
@@ -116,44 +249,57 @@ int main(int argc, char *argv[]) {
 	glfwSetInputMode(window, GLFW_STICKY_KEYS, GL_TRUE);
 
 	RoseRenderer* project = make_renderer(std::move(rose_result));
+	auto replace_project = [&](RoseResult rose_result) {
+		if (project) delete project;
+		project = make_renderer(std::move(rose_result));
+		if (project) {
+			if (project->width != width || project->height != height) {
+				width = project->width;
+				height = project->height;
+				glfwSetWindowSize(window, width * window_scale, height * window_scale);
+				glViewport(0, 0, width * window_scale, height * window_scale);
+			}
+		}
+	};
+	double next_preview = 0;
 
 	// Set up key callback
 	std::queue<int> key_queue;
 	glfwSetWindowUserPointer(window, &key_queue);
 	glfwSetKeyCallback(window, key_callback);
 
-	player.start(0);
-	int startframe = 0;
-	int frame = 0;
+	player.start(first_frame / (double) framerate);
+	int startframe = first_frame;
+	int frame = first_frame;
 	bool playing = true;
 	bool overlay_enabled = false;
 	while (glfwGetKey(window, GLFW_KEY_ESCAPE) != GLFW_PRESS && !glfwWindowShouldClose(window)) {
 		bool frame_set = false;
 
-		// Reload if changed
-		if (watches->changed()) {
-			// Reload code
+		if (watches && watches->changed()) {
+			// Reload code, abandoning any reload in progress
 			printf("\nReloading at %s\n", watches->time_text());
-			if (project) delete project;
-			rose_result = translate(main_filename, frames, WIDTH, HEIGHT, LAYERS, DEPTH);
-			if (rose_result.empty() && !rose_result.error) {
-				// Try again
-				usleep(100*1000);
-				rose_result = translate(main_filename, frames, WIDTH, HEIGHT, LAYERS, DEPTH);
-			}
-			watches.reset(new FileWatches(rose_result));
 			fflush(stdout);
+			if (translation) translation->cancel();
+			translation.reset();
+			translation.reset(new Translation(main_filename, frames, options, &cache, true));
 			if (playing) {
 				frame = startframe;
 				frame_set = true;
 			}
-			project = make_renderer(std::move(rose_result));
-			if (project) {
-				if (project->width != width || project->height != height) {
-					width = project->width;
-					height = project->height;
-					glfwSetWindowSize(window, width * window_scale, height * window_scale);
-					glViewport(0, 0, width * window_scale, height * window_scale);
+		} else if (translation) {
+			if (translation->finished()) {
+				// Show the complete animation
+				rose_result = translation->take();
+				translation.reset();
+				horizon = end_frame;
+				watches.reset(new FileWatches(rose_result));
+				replace_project(std::move(rose_result));
+			} else if (glfwGetTime() >= next_preview && translation->preview.take(rose_result, &horizon)) {
+				// Show the frames computed so far
+				next_preview = glfwGetTime() + PREVIEW_INTERVAL;
+				if (!rose_result.empty()) {
+					replace_project(std::move(rose_result));
 				}
 			}
 		}
@@ -210,9 +356,9 @@ int main(int argc, char *argv[]) {
 			}
 		}
 
-		// Clamp frame
+		// Clamp frame to the frames computed so far
+		if (frame > horizon-1) frame = horizon-1;
 		if (frame < 0) frame = 0;
-		if (frame > frames-1) frame = frames-1;
 
 		if (frame_set) {
 			player.set_time(frame / (double) framerate);
@@ -61,11 +61,7 @@ GLuint RoseRenderer::overlay_xy_loc = 0;
 RoseRenderer::RoseRenderer(RoseResult rose_result, int width, int height)
 	: rose_data(std::move(rose_result)), width(width), height(height)
 {
-	// Make vertex data
-	stable_sort(rose_data.plots.begin(), rose_data.plots.end(), [](const Plot& a, const Plot& b) {
-		if (a.t != b.t) return a.t < b.t;
-		return a.y - a.r < b.y - b.r;
-	});
+	// Make vertex data. Plots are in drawing order.
 	const float corners[6][2] = {
 		{ 1.0, -1.0 },
 		{ -1.0, -1.0 },
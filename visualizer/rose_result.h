@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <vector>
 #include <utility>
 #include <cstdio>
@@ -10,6 +11,16 @@ struct Plot {
 	short t,x,y,r,c;
 };
 
+// Drawing order of the plots within a frame. The engine blits the circles
+// of a frame line by line from their top line y - r, and those on the same
+// line most recently put first.
+inline void sortFramePlots(std::vector<Plot>::iterator begin, std::vector<Plot>::iterator end) {
+	std::reverse(begin, end);
+	std::stable_sort(begin, end, [](const Plot& a, const Plot& b) {
+		return a.y - a.r < b.y - b.r;
+	});
+}
+
 struct TintColor {
 	short t,i,rgb;
 };
@@ -39,6 +50,23 @@ struct FrameStatistics {
 
 	int copper_cycles = 0;
 	int blitter_cycles = 0;
+
+	void add(const FrameStatistics& other, int weight = 1) {
+		circles += other.circles * weight;
+		turtles_survived += other.turtles_survived * weight;
+		turtles_died += other.turtles_died * weight;
+		cpu_compute_cycles += other.cpu_compute_cycles * weight;
+		cpu_draw_cycles += other.cpu_draw_cycles * weight;
+		per_wire_cycles += other.per_wire_cycles * weight;
+		copper_cycles += other.copper_cycles * weight;
+		blitter_cycles += other.blitter_cycles * weight;
+	}
+
+	bool empty() const {
+		return circles == 0 && turtles_survived == 0 && turtles_died == 0 &&
+			cpu_compute_cycles == 0 && cpu_draw_cycles == 0 && per_wire_cycles == 0 &&
+			copper_cycles == 0 && blitter_cycles == 0;
+	}
 };
 
 struct RoseStatistics {
@@ -50,6 +78,14 @@ struct RoseStatistics {
 	int wire_capacity = 0;
 	int number_of_procedures = 0;
 	int number_of_constants = 0;
+	int specialized_procedures = 0;
+	int unused_procedures = 0;
+	// Turtle data blocks allocated by the interpreter, and how many of
+	// those were not recycled
+	long turtle_allocations = 0;
+	long system_allocations = 0;
+	// Turtles merged into identical turtles
+	long coalesced_turtles = 0;
 	std::vector<FrameStatistics> frame;
 
 	RoseStatistics(int frames, int width, int height, int layer_count, int layer_depth)
@@ -91,23 +127,56 @@ struct RoseStatistics {
 		frame[f].blitter_cycles += hwords * vsize * 12;
 	}
 
-	void print(FILE *out) {
+	int maxCircles() const {
 		int max_circles = 0;
-		int max_turtles = 0;
 		for (int i = 0 ; i < frames ; i++) {
 			if (frame[i].circles > max_circles) max_circles = frame[i].circles;
+		}
+		return max_circles;
+	}
+
+	int maxTurtles() const {
+		int max_turtles = 0;
+		for (int i = 0 ; i < frames ; i++) {
 			int turtles_alive = frame[i].turtles_survived + frame[i].turtles_died + 1;
 			if (turtles_alive > max_turtles) max_turtles = turtles_alive;
 		}
+		return max_turtles;
+	}
+
+	// Most CPU cycles used in a frame, including wire copying
+	int peakCpuCycles() const {
+		int peak = 0;
+		for (int i = 0 ; i < frames ; i++) {
+			int cycles = frame[i].cpu_compute_cycles + frame[i].per_wire_cycles * wire_capacity + frame[i].cpu_draw_cycles;
+			if (cycles > peak) peak = cycles;
+		}
+		return peak;
+	}
+
+	int peakBlitterCycles() const {
+		int peak = 0;
+		for (int i = 0 ; i < frames ; i++) {
+			if (frame[i].blitter_cycles > peak) peak = frame[i].blitter_cycles;
+		}
+		return peak;
+	}
+
+	void print(FILE *out) {
 		fprintf(out, "\n");
 		fprintf(out, "Number of frames:     %5d\n", frames);
 		fprintf(out, "Max extra wait:       %5d\n", max_overwait);
-		fprintf(out, "Max circles in frame: %5d\n", max_circles);
-		fprintf(out, "Max turtles alive:    %5d\n", max_turtles);
+		fprintf(out, "Max circles in frame: %5d\n", maxCircles());
+		fprintf(out, "Max turtles alive:    %5d\n", maxTurtles());
 		fprintf(out, "Max stack height:     %5d\n", max_stack_height);
 		fprintf(out, "Wire capacity:        %5d\n", wire_capacity);
 		fprintf(out, "Number of procedures: %5d\n", number_of_procedures);
 		fprintf(out, "Number of constants:  %5d\n", number_of_constants);
+		fprintf(out, "Specialized procs:    %5d\n", specialized_procedures);
+		fprintf(out, "Unused procs:         %5d\n", unused_procedures);
+		fprintf(out, "Turtle allocations:   %5ld\n", turtle_allocations);
+		fprintf(out, "  not recycled:       %5ld\n", system_allocations);
+		fprintf(out, "Coalesced turtles:    %5ld\n", coalesced_turtles);
 		fflush(out);
 	}
 };
@@ -5,6 +5,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <string>
+#include <map>
 #include <unordered_map>
 #include <algorithm>
 
@@ -25,59 +26,110 @@ struct VarRef {
 	int index;
 };
 
-class Scope {
-	Scope* parent;
-	Node node;
-
-	std::unordered_map<std::string,VarRef> scope_map;
+// Nested scopes over interned identifiers. Every identifier text gets a
+// dense symbol id, and the innermost definition of a symbol is found by
+// indexing with its id. Definitions in inner scopes are kept on a stack
+// and undone when their scope is closed.
+class Scopes {
+	struct Binding {
+		VarRef ref;
+		int symbol;
+		// Binding of the same symbol in an outer scope, or -1
+		int shadowed;
+	};
+
+	std::unordered_map<std::string,int> symbol_ids;
+	std::vector<VarRef> global;
+	std::vector<bool> global_defined;
+	std::vector<int> innermost;
+	std::vector<Binding> bindings;
+	// First binding and node of each open inner scope
+	std::vector<int> scope_start;
+	std::vector<Node> scope_node;
+
+	int symbol(TIdentifier var) {
+		auto it = symbol_ids.emplace(var.getText(), (int)symbol_ids.size()).first;
+		if (it->second == innermost.size()) {
+			global.emplace_back();
+			global_defined.push_back(false);
+			innermost.push_back(-1);
+		}
+		return it->second;
+	}
 
 public:
-
-	Scope(Scope* parent, Node node) : parent(parent), node(node) {}
-
+	// Add to the innermost open scope
 	template <class V>
 	void add(TIdentifier var, VarKind kind, V value) {
-		const std::string& name = var.getText();
-		if (scope_map.count(name)) {
-			throw CompileException(var, "Redefinition of " + name);
+		if (scope_start.empty()) {
+			addGlobal(var, kind, value);
+			return;
+		}
+		int s = symbol(var);
+		if (innermost[s] >= scope_start.back()) {
+			throw CompileException(var, "Redefinition of " + var.getText());
+		}
+		bindings.push_back({ { kind, static_cast<int>(value) }, s, innermost[s] });
+		innermost[s] = bindings.size() - 1;
+	}
+
+	template <class V>
+	void addGlobal(TIdentifier var, VarKind kind, V value) {
+		int s = symbol(var);
+		if (global_defined[s]) {
+			throw CompileException(var, "Redefinition of " + var.getText());
 		}
-		scope_map[name] = { kind, static_cast<int>(value) };
+		global[s] = { kind, static_cast<int>(value) };
+		global_defined[s] = true;
 	}
 
 	VarRef lookup(TIdentifier var) {
-		const std::string& name = var.getText();
-		if (scope_map.count(name)) {
-			return scope_map[name];
+		int s = symbol(var);
+		if (innermost[s] >= 0) {
+			return bindings[innermost[s]].ref;
 		}
-		if (parent == nullptr) {
-			throw CompileException(var, "Undefined variable " + name);
-		}		
-		return parent->lookup(var);
+		if (!global_defined[s]) {
+			throw CompileException(var, "Undefined variable " + var.getText());
+		}
+		return global[s];
+	}
+
+	bool definedGlobal(TIdentifier var, VarKind kind) {
+		int s = symbol(var);
+		return global_defined[s] && global[s].kind == kind;
+	}
+
+	VarRef lookupGlobal(TIdentifier var) {
+		return global[symbol(var)];
 	}
 
-	bool defined(TIdentifier var, VarKind kind) {
-		const std::string& name = var.getText();
-		return scope_map.count(name) && scope_map[name].kind == kind;
+	void push(Node node) {
+		scope_start.push_back(bindings.size());
+		scope_node.push_back(node);
 	}
 
-	Scope* pop() {
-		Scope *p = parent;
-		delete this;
-		return p;
+	void pop() {
+		while (bindings.size() > scope_start.back()) {
+			innermost[bindings.back().symbol] = bindings.back().shadowed;
+			bindings.pop_back();
+		}
+		scope_start.pop_back();
+		scope_node.pop_back();
 	}
 
-	Node getNode() {
-		return node;
+	Node node() {
+		return scope_node.back();
 	}
 };
 
 class SymbolLinking : public ProgramAdapter {
 	int current_local_index;
 	int current_fact_index;
-	Scope* global_scope;
-	Scope* current_scope;
+	Scopes scopes;
 
 	nodemap<int> when_local_index;
+	// Temp defining each local index in scope, if not a parameter
+	std::vector<ATempStatement> local_temps;
 
 	bool procedure_phase = false;
 
@@ -86,9 +138,14 @@ public:
 	std::unordered_map<std::string,ALookDecl> look_map;
 	nodemap<VarRef> var_ref;
 	nodemap<int> literal_number;
+	// Literals in procedures
+	std::vector<ANumberExpression> proc_literals;
 	nodemap<int> when_pop;
 	nodemap<int> else_pop;
 	nodemap<int> wire_index;
+	// Local index of each temp and how many times it is read
+	nodemap<int> temp_local;
+	nodemap<int> temp_reads;
 	std::vector<number_t> fact_values;
 	std::vector<number_t> constants;
 	std::unordered_map<number_t,int> constant_index;
@@ -106,24 +163,66 @@ public:
 		constant_nodes[value][node] = true;
 	}
 
-	void sortConstants() {
+	// Sort constants by value, after the given ones in the given order
+	void sortConstants(const std::vector<number_t>& first = {}) {
 		std::sort(constants.begin(), constants.end(), [](int a, int b) {
 			return (unsigned)a < (unsigned)b;
 		});
+		auto sorted = constants.begin();
+		for (number_t value : first) {
+			auto found = std::find(sorted, constants.end(), value);
+			if (found == constants.end()) continue;
+			std::rotate(sorted, found, found + 1);
+			sorted++;
+		}
+		for (int i = 0 ; i < constants.size() ; i++) {
+			constant_index[constants[i]] = i;
+		}
+	}
+
+	// Use the given constants in the given order, leaving out the others
+	void orderConstants(const std::vector<number_t>& order) {
+		constants = order;
+		constant_index.clear();
 		for (int i = 0 ; i < constants.size() ; i++) {
 			constant_index[constants[i]] = i;
 		}
 	}
 
+	// Give literals in procedures that differ by less than epsilon the same
+	// value: the most common one in each run of values spanning less than
+	// epsilon. Returns the number of values replaced.
+	int mergeLiterals(number_t epsilon) {
+		std::map<number_t,int> count;
+		for (ANumberExpression lit : proc_literals) {
+			count[literal_number[lit]]++;
+		}
+		std::unordered_map<number_t,number_t> merged;
+		auto it = count.begin();
+		while (it != count.end()) {
+			auto first = it, common = it;
+			while (it != count.end() && (int64_t)it->first - first->first < epsilon) {
+				if (it->second > common->second) common = it;
+				it++;
+			}
+			for (auto m = first; m != it; m++) {
+				if (m != common) merged[m->first] = common->first;
+			}
+		}
+		for (ANumberExpression lit : proc_literals) {
+			auto m = merged.find(literal_number[lit]);
+			if (m != merged.end()) literal_number[lit] = m->second;
+		}
+		return merged.size();
+	}
+
 	void caseAProgram(AProgram prog) override {
-		global_scope = new Scope(nullptr, prog);
-		global_scope->add(TIdentifier::make("x"), VarKind::GLOBAL, GlobalKind::X);
-		global_scope->add(TIdentifier::make("y"), VarKind::GLOBAL, GlobalKind::Y);
-		global_scope->add(TIdentifier::make("dir"), VarKind::GLOBAL, GlobalKind::DIRECTION);
-		current_scope = global_scope;
+		scopes.addGlobal(TIdentifier::make("x"), VarKind::GLOBAL, GlobalKind::X);
+		scopes.addGlobal(TIdentifier::make("y"), VarKind::GLOBAL, GlobalKind::Y);
+		scopes.addGlobal(TIdentifier::make("dir"), VarKind::GLOBAL, GlobalKind::DIRECTION);
 		int fact_index = 0;
 		traverse<AFactDecl>(prog, [&](AFactDecl fact) {
-			global_scope->add(fact.getName(), VarKind::FACT, fact_index++);
+			scopes.addGlobal(fact.getName(), VarKind::FACT, fact_index++);
 		});
 
 		visit<AFactDecl>(prog);
@@ -135,7 +234,7 @@ public:
 		int current_proc_index = 0;
 		traverse<AProcDecl>(prog, [&](AProcDecl proc) {
 			procs.push_back(proc);
-			global_scope->add(proc.getName(), VarKind::PROCEDURE, current_proc_index++);
+			scopes.addGlobal(proc.getName(), VarKind::PROCEDURE, current_proc_index++);
 			if (current_proc_index > 256) {
 				throw CompileException(proc.getName(), "Too many procedures");
 			}
@@ -143,8 +242,6 @@ public:
 		procedure_phase = true;
 
 		visit<AProcDecl>(prog);
-
-		current_scope = current_scope->pop();
 	}
 
 	void outALookDecl(ALookDecl look) override {
@@ -156,41 +253,49 @@ public:
 	}
 
 	void inAProcDecl(AProcDecl proc) override {
-		current_scope = new Scope(current_scope, proc);
+		scopes.push(proc);
 		current_local_index = 0;
+		local_temps.assign(proc.getParams().size(), ATempStatement());
 		for (auto p : proc.getParams()) {
 			ALocal local = p.cast<ALocal>();
-			current_scope->add(local.getName(), VarKind::LOCAL, current_local_index++);
+			scopes.add(local.getName(), VarKind::LOCAL, current_local_index++);
 		}
 	}
 
 	void outATempStatement(ATempStatement temp) override {
 		ALocal local = temp.getVar().cast<ALocal>();
-		current_scope->add(local.getName(), VarKind::LOCAL, current_local_index++);
+		temp_local[temp] = current_local_index;
+		temp_reads[temp] = 0;
+		local_temps.resize(current_local_index + 1);
+		local_temps[current_local_index] = temp;
+		scopes.add(local.getName(), VarKind::LOCAL, current_local_index++);
 	}
 
 	void outAWireStatement(AWireStatement wire) override {
 		ALocal local = wire.getVar().cast<ALocal>();
 		TIdentifier name = local.getName();
-		if (global_scope->defined(name, VarKind::WIRE)) {
-			wire_index[wire] = global_scope->lookup(name).index;
+		if (scopes.definedGlobal(name, VarKind::WIRE)) {
+			wire_index[wire] = scopes.lookupGlobal(name).index;
 		} else {
 			wire_index[wire] = wire_count;
-			global_scope->add(name, VarKind::WIRE, wire_count++);
+			scopes.addGlobal(name, VarKind::WIRE, wire_count++);
 			wire_names.push_back(name.getText());
 		}
 	}
 
 	void outAProcDecl(AProcDecl proc) override {
-		current_scope = current_scope->pop();
+		scopes.pop();
 	}
 
 	void inAVarExpression(AVarExpression var) override {
-		VarRef ref = current_scope->lookup(var.getName());
+		VarRef ref = scopes.lookup(var.getName());
 		if (!procedure_phase && ref.kind != VarKind::FACT) {
 			throw CompileException(var.getName(), "Variable outside procedure");
 		}
 		var_ref[var] = ref;
+		if (ref.kind == VarKind::LOCAL && local_temps[ref.index]) {
+			temp_reads[local_temps[ref.index]]++;
+		}
 	}
 
 	void inANumberExpression(ANumberExpression lit) override {
@@ -216,24 +321,26 @@ public:
 			throw CompileException(lit.getNumber(), "Number format error");
 		}
 		literal_number[lit] = value;
+		if (procedure_phase) proc_literals.push_back(lit);
 	}
 
 	void inAWhenStatement(AWhenStatement when) override {
 		when_local_index[when] = current_local_index;
-		current_scope = new Scope(current_scope, when);
+		scopes.push(when);
 	}
 
 	void inAElseMarker(AElseMarker m) override {
-		AWhenStatement when = current_scope->getNode().cast<AWhenStatement>();
+		AWhenStatement when = scopes.node().cast<AWhenStatement>();
 		when_pop[when] = current_local_index - when_local_index[when];
 		current_local_index = when_local_index[when];
-		current_scope = new Scope(current_scope->pop(), when);
+		scopes.pop();
+		scopes.push(when);
 	}
 
 	void outAWhenStatement(AWhenStatement when) override {
 		else_pop[when] = current_local_index - when_local_index[when];
 		current_local_index = when_local_index[when];
-		current_scope = current_scope->pop();
+		scopes.pop();
 	}
 
 	void inADefyStatement(ADefyStatement defy) override {
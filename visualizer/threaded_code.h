@@ -0,0 +1,432 @@
+#pragma once
+
+#include "ast.h"
+#include "symbol_linking.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Flat instruction set executed by the Interpreter. Every procedure is
+// lowered once into a contiguous run of instructions, with variables,
+// literals and operators resolved ahead of time.
+enum class Op : unsigned char {
+	// Values
+	CONST,       // a = value
+	LITERAL,     // a = value, b = literal slot (registered as constant when run)
+	FACT,        // a = fact index (only outside procedures)
+	LOCAL,       // a = stack index
+	X,
+	Y,
+	DIR,
+	WIRE,        // a = wire index
+	PROC,        // a = procedure index
+
+	// Operators
+	ADD, SUB, MUL, DIV,
+	ASL, ASR, LSR, ROL, ROR,
+	EQ, NE, LT, LE, GT, GE,
+	AND, OR,
+	NEG,
+	SINE,
+	RAND,
+
+	// Control flow
+	COND,        // a = jump target if false
+	WHEN,        // a = jump target if false
+	WHEN_DONE,   // a = locals to pop
+	ELSE_DONE,   // a = locals to pop
+	JUMP,        // a = jump target
+	RETURN,      // End of expression evaluation
+
+	// Statements
+	FORK,        // a = number of arguments, b = procedure index
+	FORK_CHECK,  // a = number of arguments, procedure value on stack
+	FORK_DYNAMIC,// a = number of arguments, procedure value below arguments
+	WIRE_WRITE,  // a = wire index
+	WAIT,
+	TURN,
+	FACE,
+	SIZE,
+	TINT,
+	SEED,
+	MOVE,
+	JUMP_XY,
+	DRAW,
+	PLOT,
+	END,
+	ERROR        // a = message index
+};
+
+struct Instruction {
+	Op op;
+	int a;
+	int b;
+};
+
+static inline int stack_effect(const Instruction& ins) {
+	switch (ins.op) {
+	case Op::CONST:
+	case Op::LITERAL:
+	case Op::FACT:
+	case Op::LOCAL:
+	case Op::X:
+	case Op::Y:
+	case Op::DIR:
+	case Op::WIRE:
+	case Op::PROC:
+	case Op::RAND:
+		return 1;
+	case Op::NEG:
+	case Op::SINE:
+	case Op::JUMP:
+	case Op::RETURN:
+	case Op::FORK_CHECK:
+	case Op::DRAW:
+	case Op::PLOT:
+	case Op::END:
+	case Op::ERROR:
+		return 0;
+	case Op::WHEN_DONE:
+	case Op::ELSE_DONE:
+	case Op::FORK:
+		return -ins.a;
+	case Op::FORK_DYNAMIC:
+		return -(ins.a + 1);
+	case Op::JUMP_XY:
+		return -2;
+	default: // Binary operators, conditions and statements
+		return -1;
+	}
+}
+
+enum class ValueKind {
+	NUMBER,
+	PROCEDURE
+};
+
+struct Value {
+	ValueKind kind;
+	union {
+		number_t number;
+		int proc;
+	};
+
+	explicit Value(int proc, bool is_procedure) : kind(ValueKind::PROCEDURE), proc(proc) {}
+	explicit Value(number_t number) : kind(ValueKind::NUMBER), number(number) {}
+	Value() : Value(0) {}
+};
+
+struct ThreadedCode {
+	std::vector<Instruction> code;
+	// Token for error and warning reporting, per instruction
+	std::vector<Token> tokens;
+	// Source line and column per instruction, for tracing. Tokens are
+	// reference counted without synchronization, so worker threads must
+	// not copy them.
+	std::vector<uint16_t> lines;
+	std::vector<uint16_t> columns;
+	// Stack height before each instruction
+	std::vector<int> heights;
+	int max_height = 0;
+	// Entry point of each procedure, indexed like SymbolLinking::procs
+	std::vector<int> proc_entry;
+	std::vector<int> proc_params;
+	std::vector<std::string> proc_names;
+	// Node behind each LITERAL slot
+	std::vector<Node> literal_nodes;
+	std::vector<std::string> messages;
+	// Whether procedures must check the kind of values when they run
+	bool checked = true;
+	// Where the branches of each when statement end
+	struct BranchEnds {
+		AWhenStatement when;
+		int when_done, else_done;
+	};
+	std::vector<BranchEnds> branch_ends;
+};
+
+// How many times each procedure was started and each branch of each when
+// statement was run, as counted by the Interpreter
+struct Profile {
+	std::vector<int64_t> runs;
+	nodemap<int64_t> when_runs;
+	nodemap<int64_t> else_runs;
+};
+
+class Lowering : private AnalysisAdapter {
+	SymbolLinking& sym;
+	ThreadedCode& out;
+	const std::vector<number_t>* fact_values;
+	int height;
+
+public:
+	Lowering(SymbolLinking& sym, ThreadedCode& out) : sym(sym), out(out), fact_values(nullptr) {}
+
+	// Lower all procedures. Fact references are resolved to their values,
+	// also in expressions lowered afterwards.
+	void lowerProcedures(const std::vector<number_t>& facts) {
+		fact_values = &facts;
+		out.proc_entry.clear();
+		out.proc_params.clear();
+		out.proc_names.clear();
+		out.branch_ends.clear();
+		for (AProcDecl proc : sym.procs) {
+			out.proc_entry.push_back(out.code.size());
+			out.proc_params.push_back(proc.getParams().size());
+			out.proc_names.push_back(proc.getName().getText());
+			height = proc.getParams().size();
+			proc.getBody().apply(*this);
+			emit(Op::END);
+		}
+	}
+
+	// Lower a single expression. Returns entry point.
+	int lowerExpression(PExpression exp) {
+		int entry = out.code.size();
+		height = 0;
+		exp.apply(*this);
+		emit(Op::RETURN);
+		return entry;
+	}
+
+private:
+	int emit(Op op, int a = 0, int b = 0, Token token = Token()) {
+		out.code.push_back({op, a, b});
+		out.tokens.push_back(token);
+		out.lines.push_back(token ? token.getLine() : 0);
+		out.columns.push_back(token ? token.getPos() : 0);
+		out.heights.push_back(height);
+		height += stack_effect(out.code.back());
+		out.max_height = std::max(out.max_height, height);
+		return out.code.size() - 1;
+	}
+
+	int here() {
+		return out.code.size();
+	}
+
+	void patch(int at, int target) {
+		out.code[at].a = target;
+	}
+
+	void emit_literal(Node node, number_t value) {
+		if (fact_values) {
+			emit(Op::LITERAL, value, out.literal_nodes.size());
+			out.literal_nodes.push_back(node);
+		} else {
+			emit(Op::CONST, value);
+		}
+	}
+
+	void emit_error(Token token, const std::string& message) {
+		emit(Op::ERROR, out.messages.size(), 0, token);
+		out.messages.push_back(message);
+	}
+
+	// Expressions
+
+	void caseABinaryExpression(ABinaryExpression exp) override {
+		exp.getLeft().apply(*this);
+		exp.getRight().apply(*this);
+		PBinop op = exp.getOp();
+		if (op.is<APlusBinop>()) {
+			emit(Op::ADD, 0, 0, op.cast<APlusBinop>().getPlus());
+		} else if (op.is<AMinusBinop>()) {
+			emit(Op::SUB, 0, 0, op.cast<AMinusBinop>().getMinus());
+		} else if (op.is<AMultiplyBinop>()) {
+			emit(Op::MUL, 0, 0, op.cast<AMultiplyBinop>().getMul());
+		} else if (op.is<ADivideBinop>()) {
+			emit(Op::DIV, 0, 0, op.cast<ADivideBinop>().getDiv());
+		} else if (op.is<AAslBinop>()) {
+			emit(Op::ASL, 0, 0, op.cast<AAslBinop>().getAsl());
+		} else if (op.is<AAsrBinop>()) {
+			emit(Op::ASR, 0, 0, op.cast<AAsrBinop>().getAsr());
+		} else if (op.is<ALsrBinop>()) {
+			emit(Op::LSR, 0, 0, op.cast<ALsrBinop>().getLsr());
+		} else if (op.is<ARolBinop>()) {
+			emit(Op::ROL, 0, 0, op.cast<ARolBinop>().getRol());
+		} else if (op.is<ARorBinop>()) {
+			emit(Op::ROR, 0, 0, op.cast<ARorBinop>().getRor());
+		} else if (op.is<AEqBinop>()) {
+			emit(Op::EQ, 0, 0, op.cast<AEqBinop>().getEq());
+		} else if (op.is<ANeBinop>()) {
+			emit(Op::NE, 0, 0, op.cast<ANeBinop>().getNe());
+		} else if (op.is<ALtBinop>()) {
+			emit(Op::LT, 0, 0, op.cast<ALtBinop>().getLt());
+		} else if (op.is<ALeBinop>()) {
+			emit(Op::LE, 0, 0, op.cast<ALeBinop>().getLe());
+		} else if (op.is<AGtBinop>()) {
+			emit(Op::GT, 0, 0, op.cast<AGtBinop>().getGt());
+		} else if (op.is<AGeBinop>()) {
+			emit(Op::GE, 0, 0, op.cast<AGeBinop>().getGe());
+		} else if (op.is<AAndBinop>()) {
+			emit(Op::AND, 0, 0, op.cast<AAndBinop>().getAnd());
+		} else if (op.is<AOrBinop>()) {
+			emit(Op::OR, 0, 0, op.cast<AOrBinop>().getOr());
+		}
+	}
+
+	void caseANegExpression(ANegExpression exp) override {
+		exp.getExpression().apply(*this);
+		emit(Op::NEG, 0, 0, exp.getToken());
+	}
+
+	void caseASineExpression(ASineExpression exp) override {
+		exp.getExpression().apply(*this);
+		emit(Op::SINE, 0, 0, exp.getToken());
+	}
+
+	void caseARandExpression(ARandExpression exp) override {
+		emit(Op::RAND);
+	}
+
+	void caseAVarExpression(AVarExpression exp) override {
+		VarRef ref = sym.var_ref[exp];
+		switch (ref.kind) {
+		case VarKind::GLOBAL:
+			switch (static_cast<GlobalKind>(ref.index)) {
+			case GlobalKind::X:
+				emit(Op::X);
+				break;
+			case GlobalKind::Y:
+				emit(Op::Y);
+				break;
+			case GlobalKind::DIRECTION:
+				emit(Op::DIR);
+				break;
+			}
+			break;
+		case VarKind::LOCAL:
+			emit(Op::LOCAL, ref.index);
+			break;
+		case VarKind::WIRE:
+			emit(Op::WIRE, ref.index, 0, exp.getName());
+			break;
+		case VarKind::FACT:
+			if (fact_values) {
+				emit_literal(exp, (*fact_values)[ref.index]);
+			} else {
+				emit(Op::FACT, ref.index, 0, exp.getName());
+			}
+			break;
+		case VarKind::PROCEDURE:
+			emit(Op::PROC, ref.index);
+			break;
+		}
+	}
+
+	void caseANumberExpression(ANumberExpression exp) override {
+		emit_literal(exp, sym.literal_number[exp]);
+	}
+
+	void caseACondExpression(ACondExpression exp) override {
+		exp.getCond().apply(*this);
+		int cond = emit(Op::COND, 0, 0, exp.getToken());
+		int else_height = height;
+		exp.getWhen().apply(*this);
+		int jump = emit(Op::JUMP);
+		patch(cond, here());
+		height = else_height;
+		exp.getElse().apply(*this);
+		patch(jump, here());
+	}
+
+	// Statements
+
+	void caseAWhenStatement(AWhenStatement s) override {
+		s.getCond().apply(*this);
+		int when = emit(Op::WHEN, 0, 0, s.getToken());
+		int else_height = height;
+		s.getWhen().apply(*this);
+		int when_done = emit(Op::WHEN_DONE, sym.when_pop[s]);
+		int jump = emit(Op::JUMP);
+		patch(when, here());
+		height = else_height;
+		s.getElse().apply(*this);
+		int else_done = emit(Op::ELSE_DONE, sym.else_pop[s]);
+		patch(jump, here());
+		out.branch_ends.push_back({s, when_done, else_done});
+	}
+
+	void caseAForkStatement(AForkStatement s) override {
+		int n_args = s.getArgs().size();
+		PExpression target = s.getProc();
+		if (target.is<AVarExpression>() && sym.var_ref[target].kind == VarKind::PROCEDURE) {
+			int index = sym.var_ref[target].index;
+			AProcDecl proc = sym.procs[index];
+			int n_params = proc.getParams().size();
+			if (n_args != n_params) {
+				emit_error(s.getToken(), "Wrong number of arguments for procedure " + proc.getName().getText() + ": "
+					+ std::to_string(n_args) + " given, " + std::to_string(n_params) + " expected");
+				return;
+			}
+			s.getArgs().apply(*this);
+			emit(Op::FORK, n_args, index, s.getToken());
+		} else {
+			target.apply(*this);
+			emit(Op::FORK_CHECK, n_args, 0, s.getToken());
+			s.getArgs().apply(*this);
+			emit(Op::FORK_DYNAMIC, n_args, 0, s.getToken());
+		}
+	}
+
+	void caseATempStatement(ATempStatement s) override {
+		s.getExpression().apply(*this);
+	}
+
+	void caseAWireStatement(AWireStatement s) override {
+		s.getExpression().apply(*this);
+		emit(Op::WIRE_WRITE, sym.wire_index[s], 0, s.getVar().cast<ALocal>().getName());
+	}
+
+	void caseAWaitStatement(AWaitStatement s) override {
+		s.getExpression().apply(*this);
+		emit(Op::WAIT, 0, 0, s.getToken());
+	}
+
+	void caseATurnStatement(ATurnStatement s) override {
+		s.getExpression().apply(*this);
+		emit(Op::TURN, 0, 0, s.getToken());
+	}
+
+	void caseAFaceStatement(AFaceStatement s) override {
+		s.getExpression().apply(*this);
+		emit(Op::FACE, 0, 0, s.getToken());
+	}
+
+	void caseASizeStatement(ASizeStatement s) override {
+		s.getExpression().apply(*this);
+		emit(Op::SIZE, 0, 0, s.getToken());
+	}
+
+	void caseATintStatement(ATintStatement s) override {
+		s.getExpression().apply(*this);
+		emit(Op::TINT, 0, 0, s.getToken());
+	}
+
+	void caseASeedStatement(ASeedStatement s) override {
+		s.getExpression().apply(*this);
+		emit(Op::SEED, 0, 0, s.getToken());
+	}
+
+	void caseAMoveStatement(AMoveStatement s) override {
+		s.getExpression().apply(*this);
+		emit(Op::MOVE, 0, 0, s.getToken());
+	}
+
+	void caseAJumpStatement(AJumpStatement s) override {
+		s.getX().apply(*this);
+		s.getY().apply(*this);
+		emit(Op::JUMP_XY, 0, 0, s.getToken());
+	}
+
+	void caseADrawStatement(ADrawStatement s) override {
+		emit(Op::DRAW, 0, 0, s.getToken());
+	}
+
+	void caseAPlotStatement(APlotStatement s) override {
+		emit(Op::PLOT, 0, 0, s.getToken());
+	}
+};
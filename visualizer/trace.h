@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Binary trace of what the turtles did, written by the interpreter when
+// tracing is enabled and read by the tracequery tool.
+//
+// The file starts with TRACE_MAGIC, the names of the procedures and the
+// names of the wires, then TraceRecords until the end, all in the byte
+// order of the machine. A list of names is a 32-bit count followed by each
+// name as a 16-bit length and the characters.
+#define TRACE_MAGIC "ROSETRC1"
+
+enum class TraceKind : uint8_t {
+	FORK,   // a = new turtle, b = its procedure
+	WAIT,   // a = wait amount
+	MOVE,   // a, b = new x and y (also for jump)
+	DRAW,   // a = size, b = tint (complemented for plot)
+	WIRE    // a = wire index, b = value, flags = 1 if a procedure
+};
+
+struct TraceRecord {
+	TraceKind kind;
+	uint8_t flags;
+	// Procedure of the turtle
+	uint16_t proc;
+	uint32_t turtle;
+	int32_t frame;
+	// Source position of the statement
+	uint16_t line;
+	uint16_t column;
+	// Turtle position in pixels after the statement
+	int16_t x, y;
+	int32_t a, b;
+};
+
+class TraceWriter {
+	FILE *file;
+
+	void writeNames(const std::vector<std::string>& names) {
+		uint32_t count = names.size();
+		fwrite(&count, sizeof(count), 1, file);
+		for (const std::string& name : names) {
+			uint16_t length = name.size();
+			fwrite(&length, sizeof(length), 1, file);
+			fwrite(name.data(), 1, length, file);
+		}
+	}
+
+public:
+	TraceWriter(const std::string& path, const std::vector<std::string>& proc_names,
+			const std::vector<std::string>& wire_names) {
+		file = fopen(path.c_str(), "wb");
+		if (!file) return;
+		fwrite(TRACE_MAGIC, 1, 8, file);
+		writeNames(proc_names);
+		writeNames(wire_names);
+	}
+
+	TraceWriter(const TraceWriter&) = delete;
+	TraceWriter& operator=(const TraceWriter&) = delete;
+
+	bool valid() {
+		return file != nullptr;
+	}
+
+	void write(const std::vector<TraceRecord>& records) {
+		fwrite(records.data(), sizeof(TraceRecord), records.size(), file);
+	}
+
+	~TraceWriter() {
+		if (file) fclose(file);
+	}
+};
+
+class TraceReader {
+	FILE *file;
+
+	bool readNames(std::vector<std::string>& names) {
+		uint32_t count;
+		if (fread(&count, sizeof(count), 1, file) != 1) return false;
+		for (uint32_t i = 0; i < count; i++) {
+			uint16_t length;
+			if (fread(&length, sizeof(length), 1, file) != 1) return false;
+			std::string name(length, ' ');
+			if (fread(&name[0], 1, length, file) != length) return false;
+			names.push_back(name);
+		}
+		return true;
+	}
+
+public:
+	std::vector<std::string> proc_names;
+	std::vector<std::string> wire_names;
+
+	TraceReader(const char *path) {
+		file = fopen(path, "rb");
+		if (!file) return;
+		char magic[8];
+		if (fread(magic, 1, 8, file) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0 ||
+				!readNames(proc_names) || !readNames(wire_names)) {
+			fclose(file);
+			file = nullptr;
+		}
+	}
+
+	TraceReader(const TraceReader&) = delete;
+	TraceReader& operator=(const TraceReader&) = delete;
+
+	bool valid() {
+		return file != nullptr;
+	}
+
+	bool next(TraceRecord& record) {
+		return fread(&record, sizeof(TraceRecord), 1, file) == 1;
+	}
+
+	~TraceReader() {
+		if (file) fclose(file);
+	}
+};
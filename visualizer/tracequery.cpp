@@ -0,0 +1,128 @@
+
+#include "trace.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Print the records of a turtle trace written with rose -trace, filtered
+// by procedure, turtle, kind, frame range or screen rectangle.
+
+static const char *kind_names[] = { "fork", "wait", "move", "draw", "wire" };
+
+static double number(int32_t n) {
+	return n / 65536.0;
+}
+
+static void usage() {
+	printf("Usage: tracequery [-proc <name>] [-turtle <id>] [-kind fork|wait|move|draw|wire] [-frames <first> <last>] [-rect <x0> <y0> <x1> <y1>] [-count] <tracefile>\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	int arg = 1;
+	const char *proc_name = nullptr;
+	long turtle = -1;
+	int kind = -1;
+	int first_frame = 0;
+	int last_frame = 0x7FFFFFFF;
+	bool rect = false;
+	int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+	bool count_only = false;
+	while (argc > arg && argv[arg][0] == '-') {
+		const char* option = argv[arg++];
+		if (strcmp(option, "-proc") == 0 && argc > arg) {
+			proc_name = argv[arg++];
+		} else if (strcmp(option, "-turtle") == 0 && argc > arg) {
+			turtle = atol(argv[arg++]);
+		} else if (strcmp(option, "-kind") == 0 && argc > arg) {
+			const char *name = argv[arg++];
+			for (int k = 0; k < 5; k++) {
+				if (strcmp(name, kind_names[k]) == 0) kind = k;
+			}
+			if (kind < 0) {
+				printf("Unknown kind: %s\n", name);
+				exit(1);
+			}
+		} else if (strcmp(option, "-frames") == 0 && argc > arg + 1) {
+			first_frame = atoi(argv[arg++]);
+			last_frame = atoi(argv[arg++]);
+		} else if (strcmp(option, "-rect") == 0 && argc > arg + 3) {
+			rect = true;
+			x0 = atoi(argv[arg++]);
+			y0 = atoi(argv[arg++]);
+			x1 = atoi(argv[arg++]);
+			y1 = atoi(argv[arg++]);
+		} else if (strcmp(option, "-count") == 0) {
+			count_only = true;
+		} else {
+			printf("Unknown option: %s\n", option);
+			exit(1);
+		}
+	}
+	if (argc != arg + 1) {
+		usage();
+	}
+
+	TraceReader reader(argv[arg]);
+	if (!reader.valid()) {
+		printf("Not a trace file: %s\n", argv[arg]);
+		exit(1);
+	}
+	int proc = -1;
+	if (proc_name) {
+		for (int p = 0; p < reader.proc_names.size(); p++) {
+			if (reader.proc_names[p] == proc_name) proc = p;
+		}
+		if (proc < 0) {
+			printf("No procedure named %s in the trace\n", proc_name);
+			exit(1);
+		}
+	}
+
+	long matches = 0;
+	TraceRecord r;
+	while (reader.next(r)) {
+		if (proc >= 0 && r.proc != proc) continue;
+		if (turtle >= 0 && r.turtle != turtle) continue;
+		if (kind >= 0 && (int)r.kind != kind) continue;
+		if (r.frame < first_frame || r.frame > last_frame) continue;
+		if (rect && (r.x < x0 || r.x > x1 || r.y < y0 || r.y > y1)) continue;
+		matches++;
+		if (count_only) continue;
+
+		printf("%6d %8u %-16s %5d:%-3d (%4d,%4d) ", r.frame, r.turtle,
+			reader.proc_names[r.proc].c_str(), r.line, r.column, r.x, r.y);
+		switch (r.kind) {
+		case TraceKind::FORK:
+			printf("fork %u %s\n", r.a, reader.proc_names[r.b].c_str());
+			break;
+		case TraceKind::WAIT:
+			printf("wait %g\n", number(r.a));
+			break;
+		case TraceKind::MOVE:
+			printf("move to %g %g\n", number(r.a), number(r.b));
+			break;
+		case TraceKind::DRAW:
+			if (r.b < 0) {
+				printf("plot size %d tint %d\n", r.a, ~r.b);
+			} else {
+				printf("draw size %d tint %d\n", r.a, r.b);
+			}
+			break;
+		case TraceKind::WIRE:
+			if (r.flags) {
+				printf("wire %s = %s\n", reader.wire_names[r.a].c_str(), reader.proc_names[r.b].c_str());
+			} else {
+				printf("wire %s = %g\n", reader.wire_names[r.a].c_str(), number(r.b));
+			}
+			break;
+		}
+	}
+	if (count_only) {
+		printf("%ld\n", matches);
+	}
+	return 0;
+}
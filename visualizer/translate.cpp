@@ -5,10 +5,17 @@
 #include "symbol_linking.h"
 #include "interpret.h"
 #include "code_generator.h"
+#include "bytecode_vm.h"
+#include "wire_coloring.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <thread>
 
 using namespace rose;
 
@@ -57,64 +64,133 @@ static AProgram loadProgram(const char *filename, std::string& current_filename,
 	return program;
 }
 
-std::vector<int> assignWires(std::vector<wire_mask_t> wire_conflicts, int* slots_out) {
-	int n = wire_conflicts.size();
-	std::vector<bool> stacked(n, false);
-	std::vector<int> assign_stack;
-	while (assign_stack.size() < n) {
-		std::vector<int> conflict_count(n);
-		int min_count = n;
-		for (int i = 0; i < n; i++) {
-			if (!stacked[i]) {
-				wire_mask_t mask = wire_conflicts[i];
-				for (int j = 0; j < n; j++) {
-					if ((mask & ((wire_mask_t)1 << j)) && !stacked[j]) {
-						conflict_count[i]++;
-					}
-				}
-				if (conflict_count[i] < min_count) min_count = conflict_count[i];
-			}
+// The first procedure, where the animation starts
+static AProcDecl mainProcedure(SymbolLinking& sym, AProgram program, int *n_proc_out) {
+	AProcDecl mainproc;
+	int n_proc = 0;
+	sym.traverse<AProcDecl>(program, [&](AProcDecl proc) {
+		if (n_proc == 0) {
+			mainproc = proc;
 		}
+		n_proc++;
+	});
+	if (n_proc == 0) {
+		throw Exception("No procedures");
+	}
+	if (mainproc.getParams().size() != 0) {
+		throw CompileException(mainproc.getName(), "Entry procedure must not have any parameters");
+	}
+	*n_proc_out = n_proc;
+	return mainproc;
+}
 
-		for (int i = 0; i < n; i++) {
-			if (!stacked[i] && conflict_count[i] == min_count) {
-				assign_stack.push_back(i);
-				stacked[i] = true;
-			}
-		}
+// The engine runs the operands fused and folded as decided by the code
+// generator after interpretation, so the CPU cycles of each frame are
+// taken from a run of the generated bytecode.
+static void takeCpuCycles(RoseStatistics& stats, const RoseStatistics& executed) {
+	for (int f = 0; f < stats.frames; f++) {
+		stats.frame[f].cpu_compute_cycles = executed.frame[f].cpu_compute_cycles;
+		stats.frame[f].cpu_draw_cycles = executed.frame[f].cpu_draw_cycles;
+		stats.frame[f].per_wire_cycles = executed.frame[f].per_wire_cycles;
 	}
+}
 
-	std::vector<int> assignment(n, -1);
-	int slots = 0;
-	while (assign_stack.size() > 0) {
-		int i = assign_stack.back();
-		assign_stack.pop_back();
-		wire_mask_t mask = wire_conflicts[i];
-		for (int s = 0; s < slots; s++) {
-			bool conflict = false;
-			for (int j = 0; j < n; j++) {
-				if ((mask & ((wire_mask_t)1 << j)) && assignment[j] == s) {
-					conflict = true;
-					break;
-				}
-			}
-			if (!conflict) {
-				assignment[i] = s;
-				break;
+static void compareEngines(const std::vector<Plot>& interpreted, RoseStatistics& interpreted_stats,
+		const std::vector<Plot>& executed, RoseStatistics& executed_stats) {
+	int frames = interpreted_stats.frames;
+	auto by_frame = [frames](const std::vector<Plot>& plots) {
+		std::vector<std::vector<Plot>> frame_plots(frames);
+		for (const Plot& p : plots) {
+			frame_plots[p.t].push_back(p);
+		}
+		for (auto& fp : frame_plots) {
+			std::sort(fp.begin(), fp.end(), [](const Plot& a, const Plot& b) {
+				if (a.y != b.y) return a.y < b.y;
+				if (a.x != b.x) return a.x < b.x;
+				if (a.r != b.r) return a.r < b.r;
+				return a.c < b.c;
+			});
+		}
+		return frame_plots;
+	};
+	std::vector<std::vector<Plot>> expected = by_frame(interpreted);
+	std::vector<std::vector<Plot>> actual = by_frame(executed);
+
+	printf("\n");
+	for (int f = 0; f < frames; f++) {
+		if (expected[f].size() != actual[f].size()) {
+			printf("Bytecode differs from interpreter in frame %d: %d circles vs %d\n",
+				f, (int)actual[f].size(), (int)expected[f].size());
+			return;
+		}
+		for (int i = 0; i < expected[f].size(); i++) {
+			const Plot& e = expected[f][i];
+			const Plot& a = actual[f][i];
+			if (e.x != a.x || e.y != a.y || e.r != a.r || e.c != a.c) {
+				printf("Bytecode differs from interpreter in frame %d: circle (%d,%d) size %d tint %d vs (%d,%d) size %d tint %d\n",
+					f, a.x, a.y, a.r, a.c, e.x, e.y, e.r, e.c);
+				return;
 			}
 		}
-		if (assignment[i] == -1) {
-			assignment[i] = slots++;
+		int expected_survived = interpreted_stats.frame[f].turtles_survived;
+		int actual_survived = executed_stats.frame[f].turtles_survived;
+		if (expected_survived != actual_survived) {
+			printf("Bytecode differs from interpreter in frame %d: %d turtles survived vs %d\n",
+				f, actual_survived, expected_survived);
+			return;
 		}
 	}
+	printf("Bytecode matches interpreter\n");
+}
+
+TranslationCache::TranslationCache() : record(new InterpretRecord) {}
+TranslationCache::~TranslationCache() {}
 
-	*slots_out = slots;
-	return assignment;
+void TranslatePreview::start(const RoseResult& shape, int max_time, std::vector<TintColor> colors) {
+	std::lock_guard<std::mutex> lock(mutex);
+	preview.paths = shape.paths;
+	preview.width = shape.width;
+	preview.height = shape.height;
+	preview.layer_count = shape.layer_count;
+	preview.layer_depth = shape.layer_depth;
+	preview.plots.clear();
+	preview.colors = std::move(colors);
+	preview.stats.reset(new RoseStatistics(max_time, shape.width, shape.height, shape.layer_count, shape.layer_depth));
+	preview.error = false;
+	frames = 0;
+	changed = false;
+}
+
+void TranslatePreview::publish(const std::vector<Plot>& plots, int frames) {
+	std::lock_guard<std::mutex> lock(mutex);
+	preview.plots.insert(preview.plots.end(), plots.begin() + preview.plots.size(), plots.end());
+	this->frames = frames;
+	changed = true;
+}
+
+bool TranslatePreview::take(RoseResult& result, int *frames) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!changed) return false;
+	result.paths = preview.paths;
+	result.width = preview.width;
+	result.height = preview.height;
+	result.layer_count = preview.layer_count;
+	result.layer_depth = preview.layer_depth;
+	result.plots = preview.plots;
+	result.colors = preview.colors;
+	result.stats.reset(new RoseStatistics(*preview.stats));
+	result.error = false;
+	*frames = this->frames;
+	changed = false;
+	return true;
 }
 
 RoseResult translate(const char *filename, int max_time,
                      int width, int height,
-                     int layer_count, int layer_depth) {
+                     int layer_count, int layer_depth,
+                     const TranslateOptions& options,
+                     TranslationCache *cache,
+                     TranslatePreview *preview) {
 	RoseResult result;
 	result.width = width;
 	result.height = height;
@@ -130,21 +206,13 @@ RoseResult translate(const char *filename, int max_time,
 		try {
 			SymbolLinking sym(rep, parts);
 			program.apply(sym);
-			Interpreter in(rep, sym);
-			AProcDecl mainproc;
-			int n_proc = 0;
-			sym.traverse<AProcDecl>(program, [&](AProcDecl proc) {
-				if (n_proc == 0) {
-					mainproc = proc;
-				}
-				n_proc++;
-			});
-			if (n_proc == 0) {
-				throw Exception("No procedures");
-			}
-			if (mainproc.getParams().size() != 0) {
-				throw CompileException(mainproc.getName(), "Entry procedure must not have any parameters");
+			if (options.merge_epsilon > 0) {
+				int merged = sym.mergeLiterals(options.merge_epsilon);
+				if (merged > 0) printf("Merged %d literal values into nearby values\n", merged);
 			}
+			Interpreter in(rep, sym, options);
+			int n_proc;
+			AProcDecl mainproc = mainProcedure(sym, program, &n_proc);
 
 			in.get_form(program, &width, &height, &layer_count, &layer_depth);
 			result.width = width;
@@ -155,12 +223,34 @@ RoseResult translate(const char *filename, int max_time,
 			result.stats.reset(new RoseStatistics(max_time, width, height, layer_count, layer_depth));
 			RoseStatistics& stats = *result.stats;
 
-			result.plots = in.interpret(mainproc, &stats);
+			in.evaluate_facts(mainproc.parent().cast<AProgram>());
+			if (preview) {
+				// Colors for the preview, evaluated separately to leave the
+				// constants of the final color script alone.
+				std::vector<TintColor> preview_colors;
+				try {
+					Interpreter palette(rep, sym);
+					preview_colors = palette.get_colors(program);
+				} catch (const Exception&) {
+					// Reported by the final color script
+				}
+				preview->start(result, max_time, std::move(preview_colors));
+			}
+
+			result.plots = in.interpret(mainproc, &stats, cache ? cache->record.get() : nullptr, preview);
+			if (in.resumed_frame > 0) {
+				printf("Reused %d frames from the previous run\n", in.resumed_frame);
+			}
+			if (options.jit && !in.jit_active()) {
+				printf("Native code not available, using interpreter\n");
+			}
 			result.colors = in.get_colors(program);
 
 			// Output
-			std::vector<int> wire_assignment = assignWires(in.wire_conflicts, &stats.wire_capacity);
-			CodeGenerator codegen(rep, parts, sym, wire_assignment, stats);
+			WireColoring wire_coloring(in.wire_conflicts);
+			stats.wire_capacity = wire_coloring.slots;
+			const std::vector<int>& wire_assignment = wire_coloring.assignment;
+			CodeGenerator codegen(rep, parts, sym, wire_assignment, stats, in.profile());
 			auto bytecodes_and_constants = codegen.generate(program);
 			std::vector<bytecode_t> bytecodes = bytecodes_and_constants.first;
 			std::vector<number_t> constants = bytecodes_and_constants.second;
@@ -175,9 +265,37 @@ RoseResult translate(const char *filename, int max_time,
 				colorscript.push_back(c.rgb | (c.i << 12));
 			}
 			colorscript.push_back(0x8000);
-			writefile(bytecodes, "bytecodes.bin");
-			writefile(constants, "constants.bin");
-			writefile(colorscript, "colorscript.bin");
+			bool partial = options.stop_frame > 0 && options.stop_frame < max_time;
+			if (partial) {
+				// Wire assignment and constants only cover the frames interpreted
+				printf("Interpreted up to frame %d, output files not written\n", options.stop_frame);
+			} else {
+				writefile(bytecodes, "bytecodes.bin");
+				writefile(constants, "constants.bin");
+				writefile(colorscript, "colorscript.bin");
+			}
+
+			// Run bytecode
+			std::unique_ptr<RoseStatistics> vm_stats;
+			std::vector<Plot> vm_plots;
+			std::string vm_error;
+			if (options.engine != Engine::INTERPRETER || !partial) {
+				vm_stats.reset(new RoseStatistics(max_time, width, height, layer_count, layer_depth));
+				try {
+					BytecodeVM vm(bytecodes, constants);
+					vm_plots = vm.run(vm_stats.get());
+				} catch (const Exception& exc) {
+					if (options.engine == Engine::BYTECODE) throw;
+					vm_error = exc.getMessage();
+				}
+				if (options.engine == Engine::BYTECODE) {
+					result.plots = std::move(vm_plots);
+					stats.frame = std::move(vm_stats->frame);
+					stats.max_overwait = vm_stats->max_overwait;
+				} else if (vm_error.empty() && !partial) {
+					takeCpuCycles(stats, *vm_stats);
+				}
+			}
 
 			// Print various statistics
 			stats.number_of_procedures = n_proc;
@@ -194,6 +312,48 @@ RoseResult translate(const char *filename, int max_time,
 				}
 				printf("\n");
 			}
+			if (wire_coloring.slots < wire_coloring.greedy_slots || !wire_coloring.optimal) {
+				int64_t wire_cycles = 0;
+				for (int f = 0; f < stats.frames; f++) {
+					wire_cycles += stats.frame[f].per_wire_cycles;
+				}
+				printf("Wire slot search: %d slots, greedy coloring %d, ", wire_coloring.slots, wire_coloring.greedy_slots);
+				if (wire_coloring.optimal) {
+					printf("optimal");
+				} else {
+					printf("at least %d, search stopped after %ld steps", wire_coloring.lower_bound, wire_coloring.work);
+				}
+				printf(", %lld wire copy cycles saved\n", (long long)(wire_coloring.greedy_slots - wire_coloring.slots) * wire_cycles);
+			}
+
+			int64_t total_saved = 0;
+			for (int p = 0; p < sym.procs.size(); p++) {
+				if (codegen.saved_cycles[p] == 0) continue;
+				if (total_saved == 0) printf("\nCycles saved by profile-guided layout:\n");
+				printf("%12lld %s\n", (long long)codegen.saved_cycles[p], sym.procs[p].getName().getText().c_str());
+				total_saved += codegen.saved_cycles[p];
+			}
+			if (total_saved != 0) {
+				printf("%12lld total\n", (long long)total_saved);
+			}
+
+			const CodeGenerator::Layout& before = codegen.layout_before;
+			const CodeGenerator::Layout& after = codegen.layout_after;
+			auto layout_row = [](const char *name, int64_t before, int64_t after) {
+				printf("%-28s%11lld %11lld\n", name, (long long)before, (long long)after);
+			};
+			printf("\n%-28s%11s %11s\n", "Layout for size:", "before", "after");
+			layout_row("Constants:", before.constants, after.constants);
+			layout_row("Constant bytes:", before.constants * 4, after.constants * 4);
+			layout_row("Big constant references:", before.big_constants, after.big_constants);
+			layout_row("Bytecode bytes:", before.code_bytes, after.code_bytes);
+			layout_row("Packed bytecode (estimate):", before.packed_bytes, after.packed_bytes);
+			if (before.operand_cycles != 0) {
+				layout_row("Constant operand cycles:", before.operand_cycles, after.operand_cycles);
+			}
+			if (after.big_constants == 0) {
+				printf("No big constants: USEBIGCONSTANT can be 0 in RoseConfig.S\n");
+			}
 
 			printf("\n");
 			int n = sym.constants.size();
@@ -215,11 +375,24 @@ RoseResult translate(const char *filename, int max_time,
 				}
 				printf("\n");
 			}
+
+			if (options.engine == Engine::COMPARE) {
+				if (vm_error.empty()) {
+					compareEngines(result.plots, stats, vm_plots, *vm_stats);
+				} else {
+					printf("\nBytecode failed: %s\n", vm_error.c_str());
+				}
+			} else if (!vm_error.empty()) {
+				printf("\nBytecode failed: %s\nCPU cycles are counted without fused instructions\n", vm_error.c_str());
+			}
 			fflush(stdout);
 
 		} catch (const CompileException& exc) {
 			rep.reportError(exc);
 			result.error = true;
+		} catch (const TranslateCancelled&) {
+			printf("Translation cancelled\n");
+			fflush(stdout);
 		}
 	} catch (const Exception& exc) {
 		printf("%s: %s\n", current_filename.c_str(), exc.getMessage().c_str());
@@ -230,3 +403,180 @@ RoseResult translate(const char *filename, int max_time,
 	return result;
 }
 
+bool parseFactSweep(const char *text, FactSweep *sweep) {
+	const char *equals = strchr(text, '=');
+	if (equals == nullptr || equals == text) return false;
+	sweep->name.assign(text, equals - text);
+	sweep->values.clear();
+	const char *p = equals + 1;
+	while (true) {
+		char *end;
+		double first = strtod(p, &end);
+		if (end == p) return false;
+		if (end[-1] == '.' && end[0] == '.') {
+			// The dot belongs to the range
+			end--;
+		}
+		double last = first;
+		double step = 1;
+		p = end;
+		if (p[0] == '.' && p[1] == '.') {
+			last = strtod(p + 2, &end);
+			if (end == p + 2) return false;
+			p = end;
+			if (*p == ':') {
+				step = strtod(p + 1, &end);
+				if (end == p + 1 || step <= 0) return false;
+				p = end;
+			}
+		}
+		int count = (int)floor((last - first) / step + 1e-9) + 1;
+		for (int i = 0; i < count; i++) {
+			sweep->values.push_back((int)lround((first + i * step) * 65536));
+		}
+		if (*p == '\0') return !sweep->values.empty();
+		if (*p != ',') return false;
+		p++;
+	}
+}
+
+// Statistics of one combination of fact values in a sweep
+struct SweepVariant {
+	std::vector<FactOverride> facts;
+	std::string error;
+	int warnings = 0;
+	int peak_cpu = 0;
+	int peak_blitter = 0;
+	int max_turtles = 0;
+	int max_circles = 0;
+	int max_overwait = 0;
+};
+
+void sweep(const char *filename, int max_time,
+           int width, int height,
+           int layer_count, int layer_depth,
+           const TranslateOptions& options,
+           const std::vector<FactSweep>& facts) {
+	// Every combination, varying the last fact fastest
+	std::vector<SweepVariant> variants(1);
+	for (const FactSweep& fact : facts) {
+		std::vector<SweepVariant> extended;
+		for (const SweepVariant& variant : variants) {
+			for (int value : fact.values) {
+				extended.push_back(variant);
+				extended.back().facts.push_back({fact.name, value});
+			}
+		}
+		variants = std::move(extended);
+	}
+
+	// Each thread parses and links the program once and runs its share of
+	// the variants on copies of the linked symbols. Syntax trees are not
+	// shared between threads, since their nodes are reference counted.
+	int n_threads = options.threads > 1 ? options.threads : std::thread::hardware_concurrency();
+	n_threads = std::max(1, std::min<int>(n_threads, variants.size()));
+	std::atomic<int> next_variant(0);
+	std::atomic<bool> failed(false);
+	std::mutex print_mutex;
+	auto work = [&](bool report) {
+		std::string current_filename;
+		try {
+			nodemap<AProgram> parts;
+			nodemap<std::string> part_path;
+			std::vector<std::string> paths;
+			AProgram program = loadProgram(filename, current_filename, parts, part_path, paths);
+			Reporter rep(filename, program, parts, part_path);
+			if (!report) rep.silence();
+			SymbolLinking sym(rep, parts);
+			int n_proc;
+			AProcDecl mainproc;
+			try {
+				program.apply(sym);
+				if (options.merge_epsilon > 0) sym.mergeLiterals(options.merge_epsilon);
+				mainproc = mainProcedure(sym, program, &n_proc);
+			} catch (const CompileException& exc) {
+				if (report) rep.reportError(exc);
+				failed = true;
+				return;
+			}
+			rep.silence();
+
+			for (int v = next_variant++; v < variants.size() && !failed; v = next_variant++) {
+				SweepVariant& variant = variants[v];
+				Reporter variant_rep = rep;
+				SymbolLinking variant_sym = sym;
+				TranslateOptions variant_options = options;
+				variant_options.threads = 1;
+				variant_options.trace_file.clear();
+				variant_options.facts.insert(variant_options.facts.end(), variant.facts.begin(), variant.facts.end());
+				try {
+					Interpreter in(variant_rep, variant_sym, variant_options);
+					int w = width, h = height, count = layer_count, depth = layer_depth;
+					in.get_form(program, &w, &h, &count, &depth);
+					RoseStatistics stats(max_time, w, h, count, depth);
+					in.evaluate_facts(mainproc.parent().cast<AProgram>());
+					in.interpret(mainproc, &stats);
+					WireColoring wire_coloring(in.wire_conflicts);
+					stats.wire_capacity = wire_coloring.slots;
+					if (!(options.stop_frame > 0 && options.stop_frame < max_time)) {
+						CodeGenerator codegen(variant_rep, parts, variant_sym, wire_coloring.assignment, stats, in.profile());
+						auto bytecodes_and_constants = codegen.generate(program);
+						RoseStatistics executed(max_time, w, h, count, depth);
+						BytecodeVM vm(bytecodes_and_constants.first, bytecodes_and_constants.second);
+						vm.run(&executed);
+						takeCpuCycles(stats, executed);
+					}
+					variant.peak_cpu = stats.peakCpuCycles();
+					variant.peak_blitter = stats.peakBlitterCycles();
+					variant.max_turtles = stats.maxTurtles();
+					variant.max_circles = stats.maxCircles();
+					variant.max_overwait = stats.max_overwait;
+				} catch (const CompileException& exc) {
+					variant.error = variant_rep.position(exc.getToken()) + ": " + exc.getMessage();
+				} catch (const TranslateCancelled&) {
+					variant.error = "Cancelled";
+				} catch (const Exception& exc) {
+					variant.error = exc.getMessage();
+				}
+				variant.warnings = variant_rep.warnings();
+			}
+		} catch (const Exception& exc) {
+			if (report) {
+				std::lock_guard<std::mutex> lock(print_mutex);
+				printf("%s: %s\n", current_filename.c_str(), exc.getMessage().c_str());
+			}
+			failed = true;
+		}
+	};
+	std::vector<std::thread> threads;
+	for (int i = 1; i < n_threads; i++) {
+		threads.emplace_back(work, false);
+	}
+	work(true);
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+	if (failed) {
+		fflush(stdout);
+		return;
+	}
+
+	// Comparison table
+	printf("\n");
+	for (const FactSweep& fact : facts) {
+		printf("%*s ", std::max<int>(fact.name.size(), 8), fact.name.c_str());
+	}
+	printf("%10s %10s %8s %8s %8s %8s\n", "Peak CPU", "Peak blit", "Turtles", "Circles", "Overwait", "Warnings");
+	for (const SweepVariant& variant : variants) {
+		for (int i = 0; i < facts.size(); i++) {
+			printf("%*g ", std::max<int>(facts[i].name.size(), 8), variant.facts[i].value / 65536.0);
+		}
+		if (variant.error.empty()) {
+			printf("%10d %10d %8d %8d %8d %8d\n", variant.peak_cpu, variant.peak_blitter,
+				variant.max_turtles, variant.max_circles, variant.max_overwait, variant.warnings);
+		} else {
+			printf("Error: %s\n", variant.error.c_str());
+		}
+	}
+	fflush(stdout);
+}
@@ -2,6 +2,122 @@
 
 #include "rose_result.h"
 
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Max turtles alive at the same time in the engine (MAX_TURTLES in
+// engine/RoseConfig.S)
+#define ENGINE_MAX_TURTLES 500
+
+enum class Engine {
+	// Animation from the AST interpreter
+	INTERPRETER,
+	// Animation from running the generated bytecode
+	BYTECODE,
+	// Animation from the interpreter, checked against the bytecode
+	COMPARE
+};
+
+// Value given to a fact instead of the value of its expression
+struct FactOverride {
+	std::string name;
+	// 16:16 fixed point
+	int value;
+};
+
+struct TranslateOptions {
+	Engine engine = Engine::INTERPRETER;
+	// Run procedures as native code where supported
+	bool jit = false;
+	// Number of threads running turtles
+	int threads = 1;
+	// Run turtles in lockstep batches
+	bool batch = false;
+	// Stop interpreting at this frame, if positive
+	int stop_frame = 0;
+	// Run identical turtles as one
+	bool coalesce = false;
+	// Write a trace of what the turtles do to this file, if not empty
+	std::string trace_file;
+	// Facts with values given from outside the program
+	std::vector<FactOverride> facts;
+	// Give literals in procedures that differ by less than this the same
+	// value, if positive. 16:16 fixed point.
+	int merge_epsilon = 0;
+
+	// Limits for interpretation, if positive. Exceeding one is an error.
+	// Turtles alive at the same time
+	long max_turtles = 100 * ENGINE_MAX_TURTLES;
+	// Times turtles are run, each run lasting until the turtle waits or dies
+	long max_runs = 0;
+	// Seconds of interpretation
+	double max_seconds = 0;
+	// Bytes of turtle data
+	long max_memory = 1L << 30;
+
+	// Set from another thread to stop the translation
+	const std::atomic<bool> *cancel = nullptr;
+};
+
+// Thrown when a translation is cancelled
+struct TranslateCancelled {};
+
+// Results kept between translations of the same program, so that
+// reloading an edited program only redoes the affected work.
+class TranslationCache {
+public:
+	TranslationCache();
+	~TranslationCache();
+
+	std::unique_ptr<struct InterpretRecord> record;
+};
+
+// Frames of a translation in progress, published by the translating thread
+// so they can be shown before the translation is done.
+class TranslatePreview {
+	std::mutex mutex;
+	RoseResult preview;
+	int frames = 0;
+	bool changed = false;
+
+public:
+	// Number of frames between each publication
+	static const int INTERVAL = 50;
+
+	// Called by the translating thread
+	void start(const RoseResult& shape, int max_time, std::vector<TintColor> colors);
+	void publish(const std::vector<Plot>& plots, int frames);
+
+	// Called by the visualizer. Gives the frames published so far, if any
+	// were published since the last call.
+	bool take(RoseResult& result, int *frames);
+};
+
 RoseResult translate(const char *filename, int max_time,
                      int width, int height,
-                     int layer_count, int layer_depth);
+                     int layer_count, int layer_depth,
+                     const TranslateOptions& options = TranslateOptions(),
+                     TranslationCache *cache = nullptr,
+                     TranslatePreview *preview = nullptr);
+
+// Values to try for a fact in a parameter sweep
+struct FactSweep {
+	std::string name;
+	std::vector<int> values;
+};
+
+// Parse a fact sweep given as name=values, where values is a comma
+// separated list of numbers and ranges first..last or first..last:step
+bool parseFactSweep(const char *text, FactSweep *sweep);
+
+// Interpret the program once for every combination of fact values and
+// print a table comparing the statistics of the variants. The variants
+// run in parallel, each on a single thread.
+void sweep(const char *filename, int max_time,
+           int width, int height,
+           int layer_count, int layer_depth,
+           const TranslateOptions& options,
+           const std::vector<FactSweep>& facts);
@@ -0,0 +1,704 @@
+#pragma once
+
+#include "turtle_runner.h"
+
+#include <algorithm>
+#include <numeric>
+#include <vector>
+
+// Execution of a group of turtles in lockstep, with the state of the turtles
+// stored as structure-of-arrays lanes. Compiled code only jumps forward, so
+// each instruction can run for all lanes waiting at its position before
+// moving on to the lowest position of any lane. Lanes that took different
+// branches join again at the end of the conditional.
+//
+// Operations on values and turtle state run as plain loops over the lanes,
+// which the compiler can vectorize. Rare operations run one lane at a time
+// through the scalar step of the runner.
+//
+// Effects are tagged with their lane and put back in lane order afterwards,
+// so the result is the same as running the turtles one after another.
+class TurtleBatch {
+public:
+	static const int LANES = 32;
+
+private:
+	TurtleRunner& runner;
+	const ThreadedCode& code;
+
+	// Per lane state
+	int lanes;
+	State *turtle[LANES];
+	unsigned pc[LANES];
+	bool active[LANES];
+	bool forked[LANES];
+	int cycles[LANES];
+	FrameStatistics *frame[LANES];
+	number_t x[LANES], y[LANES], size[LANES], direction[LANES], seed[LANES];
+
+	// Stack, indexed by slot * LANES + lane
+	std::vector<number_t> numbers;
+	std::vector<ValueKind> kinds;
+
+	// Values of one lane, gathered for forks and waits
+	std::vector<Value> gathered;
+
+	// Effects, with the lane of each
+	TurtleEffects *out;
+	std::vector<int> plot_lane, scheduled_lane, warning_lane;
+
+	// First lane that failed. Later lanes would not have run.
+	int error_lane;
+	TurtleError error;
+
+	static const unsigned DONE = ~0u;
+
+	number_t *num(int slot) {
+		return &numbers[slot * LANES];
+	}
+
+	ValueKind *kind(int slot) {
+		return &kinds[slot * LANES];
+	}
+
+	// Cycles are collected per lane and added to the frame when it changes
+	void cpu(int n) {
+		for (int l = 0; l < lanes; l++) {
+			cycles[l] += active[l] ? n : 0;
+		}
+	}
+
+	void cpu(int l, int n) {
+		cycles[l] += n;
+	}
+
+	// Batched turtles all have weight 1
+	void count(int at) {
+		for (int l = 0; l < lanes; l++) {
+			runner.counts[at] += active[l];
+		}
+	}
+
+	void flush(int l) {
+		if (frame[l] != nullptr) frame[l]->cpu_compute_cycles += cycles[l];
+		cycles[l] = 0;
+	}
+
+	void warn(int l, int at, const char *message) {
+		out->warnings.emplace_back(at, message);
+		warning_lane.push_back(l);
+	}
+
+	void fail(int l, TurtleError lane_error) {
+		error_lane = l;
+		error = std::move(lane_error);
+		for (int k = l; k < lanes; k++) {
+			active[k] = false;
+			pc[k] = DONE;
+		}
+	}
+
+	// Check that a stack slot holds a number in all active lanes
+	void check(int slot, int at, const char *message) {
+		if (!code.checked) return;
+		ValueKind *k = kind(slot);
+		for (int l = 0; l < lanes; l++) {
+			if (active[l] && k[l] != ValueKind::NUMBER) {
+				fail(l, TurtleError(at, message));
+			}
+		}
+	}
+
+	void load(int l, const State& s) {
+		x[l] = s.x;
+		y[l] = s.y;
+		size[l] = s.size;
+		direction[l] = s.direction;
+		seed[l] = s.seed;
+	}
+
+	void store(int l, State& s) {
+		s.x = x[l];
+		s.y = y[l];
+		s.size = size[l];
+		s.direction = direction[l];
+		s.seed = seed[l];
+	}
+
+	Value *gather(int l, int begin, int end) {
+		for (int slot = begin; slot < end; slot++) {
+			gathered[slot - begin].kind = kind(slot)[l];
+			gathered[slot - begin].number = num(slot)[l];
+		}
+		return gathered.data();
+	}
+
+	void push(int slot, number_t value) {
+		number_t *n = num(slot);
+		ValueKind *k = kind(slot);
+		for (int l = 0; l < lanes; l++) {
+			n[l] = active[l] ? value : n[l];
+			k[l] = active[l] ? ValueKind::NUMBER : k[l];
+		}
+		cpu(12 + 16);
+	}
+
+	void push(int slot, const number_t *values) {
+		number_t *n = num(slot);
+		ValueKind *k = kind(slot);
+		for (int l = 0; l < lanes; l++) {
+			n[l] = active[l] ? values[l] : n[l];
+			k[l] = active[l] ? ValueKind::NUMBER : k[l];
+		}
+		cpu(12 + 16);
+	}
+
+	template <class F>
+	void binary(int at, int h, F eval) {
+		cpu(20);
+		check(h - 2, at, "Left side of operation is not a number");
+		check(h - 1, at, "Right side of operation is not a number");
+		number_t *a = num(h - 2);
+		number_t *b = num(h - 1);
+		for (int l = 0; l < lanes; l++) {
+			number_t result = eval(a[l], b[l]);
+			a[l] = active[l] ? result : a[l];
+		}
+	}
+
+	template <class F>
+	void shift(int at, int h, int mask, F eval) {
+		number_t *b = num(h - 1);
+		for (int l = 0; l < lanes; l++) {
+			cycles[l] += active[l] ? ((b[l] >> 16) & mask) * 2 : 0;
+		}
+		binary(at, h, eval);
+	}
+
+	// Run one instruction in a lane through the scalar interpreter
+	void scalar(int at, int l) {
+		State& s = *turtle[l];
+		store(l, s);
+		flush(l);
+		runner.state = std::move(s);
+		runner.frame_stats = frame[l];
+		runner.forked_in_frame = forked[l];
+		runner.suspended = false;
+		runner.effects = out;
+		size_t plots = out->plots.size();
+		size_t scheduled = out->scheduled.size();
+		size_t warnings = out->warnings.size();
+		Value *stack = runner.stack_buffer.data();
+		std::copy(gather(l, 0, code.heights[at]), gathered.data() + code.heights[at], stack);
+		Value *sp = stack + code.heights[at];
+		unsigned next = DONE;
+		bool failed = false;
+		try {
+			next = runner.step(at, sp);
+		} catch (const TurtleError& lane_error) {
+			fail(l, lane_error);
+			failed = true;
+		}
+		plot_lane.resize(plot_lane.size() + (out->plots.size() - plots), l);
+		scheduled_lane.resize(scheduled_lane.size() + (out->scheduled.size() - scheduled), l);
+		warning_lane.resize(warning_lane.size() + (out->warnings.size() - warnings), l);
+		s = std::move(runner.state);
+		if (failed) return;
+
+		for (int slot = 0; slot < sp - stack; slot++) {
+			kind(slot)[l] = stack[slot].kind;
+			num(slot)[l] = stack[slot].number;
+		}
+		load(l, s);
+		forked[l] = runner.forked_in_frame;
+		frame[l] = runner.frame_stats;
+		pc[l] = next;
+		if (runner.suspended) {
+			out->scheduled.push_back(std::move(s));
+			scheduled_lane.push_back(l);
+		}
+	}
+
+	void step(int at) {
+		const Instruction& ins = code.code[at];
+		int h = code.heights[at];
+		for (int l = 0; l < lanes; l++) {
+			pc[l] = active[l] ? at + 1 : pc[l];
+		}
+		switch (ins.op) {
+		// Values
+		case Op::CONST:
+			push(h, ins.a);
+			break;
+		case Op::LITERAL:
+			if (!runner.literal_seen[ins.b]) {
+				runner.effects = out;
+				runner.literal(ins.b, ins.a);
+			}
+			push(h, ins.a);
+			break;
+		case Op::LOCAL: {
+			number_t *n = num(h);
+			ValueKind *k = kind(h);
+			number_t *local_n = num(ins.a);
+			ValueKind *local_k = kind(ins.a);
+			for (int l = 0; l < lanes; l++) {
+				n[l] = active[l] ? local_n[l] : n[l];
+				k[l] = active[l] ? local_k[l] : k[l];
+			}
+			cpu(12 + 16);
+			break;
+		}
+		case Op::X:
+			push(h, x);
+			break;
+		case Op::Y:
+			push(h, y);
+			break;
+		case Op::DIR:
+			push(h, direction);
+			break;
+		case Op::PROC: {
+			number_t *n = num(h);
+			ValueKind *k = kind(h);
+			for (int l = 0; l < lanes; l++) {
+				n[l] = active[l] ? ins.a : n[l];
+				k[l] = active[l] ? ValueKind::PROCEDURE : k[l];
+			}
+			cpu(12 + 16);
+			break;
+		}
+
+		// Operators
+		case Op::ADD:
+			binary(at, h, [](number_t a, number_t b) { return a + b; });
+			break;
+		case Op::SUB:
+			binary(at, h, [](number_t a, number_t b) { return a - b; });
+			break;
+		case Op::MUL: {
+			cpu(126);
+			check(h - 2, at, "Left side of operation is not a number");
+			check(h - 1, at, "Right side of operation is not a number");
+			number_t *a = num(h - 2);
+			number_t *b = num(h - 1);
+			for (int l = 0; l < lanes; l++) {
+				if (!active[l]) continue;
+				if (a[l] >= (128 << 16) || a[l] < -(128 << 16)) {
+					warn(l, at, "Left operand overflows");
+				}
+				if (b[l] >= (128 << 16) || b[l] < -(128 << 16)) {
+					warn(l, at, "Right operand overflows");
+				}
+				a[l] = (a[l] << 8 >> 16) * (b[l] << 8 >> 16);
+			}
+			break;
+		}
+		case Op::DIV: {
+			cpu(218);
+			check(h - 2, at, "Left side of operation is not a number");
+			check(h - 1, at, "Right side of operation is not a number");
+			number_t *a = num(h - 2);
+			number_t *b = num(h - 1);
+			for (int l = 0; l < lanes; l++) {
+				if (!active[l]) continue;
+				bool overflow = b[l] >= (128 << 16) || b[l] < -(128 << 16);
+				if (overflow) {
+					warn(l, at, "Right operand overflows");
+				}
+				int divisor = b[l] << 8 >> 16;
+				if (divisor == 0) {
+					fail(l, TurtleError(at, "Division by zero"));
+					break;
+				}
+				if (overflow) {
+					warn(l, at, "Result overflows");
+				}
+				a[l] = (a[l] / divisor) << 8;
+			}
+			break;
+		}
+		case Op::ASL:
+			shift(at, h, 63, [](number_t a, number_t b) {
+				int shift = (b >> 16) & 63;
+				return shift >= 32 ? 0 : a << shift;
+			});
+			break;
+		case Op::ASR:
+			shift(at, h, 63, [](number_t a, number_t b) {
+				int shift = (b >> 16) & 63;
+				return shift >= 32 ? -1 : a >> shift;
+			});
+			break;
+		case Op::LSR:
+			shift(at, h, 63, [](number_t a, number_t b) {
+				int shift = (b >> 16) & 63;
+				return shift >= 32 ? 0 : (number_t)((unsigned)a >> shift);
+			});
+			break;
+		case Op::ROL:
+			shift(at, h, 31, [](number_t a, number_t b) {
+				int shift = (b >> 16) & 31;
+				return shift == 0 ? a : (number_t)((a << shift) | ((unsigned)a >> (32 - shift)));
+			});
+			break;
+		case Op::ROR:
+			shift(at, h, 31, [](number_t a, number_t b) {
+				int shift = (b >> 16) & 31;
+				return shift == 0 ? a : (number_t)(((unsigned)a >> shift) | (a << (32 - shift)));
+			});
+			break;
+		case Op::EQ:
+			binary(at, h, [](number_t a, number_t b) { return a == b ? MAKE_NUMBER(1) : MAKE_NUMBER(0); });
+			break;
+		case Op::NE:
+			binary(at, h, [](number_t a, number_t b) { return a != b ? MAKE_NUMBER(1) : MAKE_NUMBER(0); });
+			break;
+		case Op::LT:
+			binary(at, h, [](number_t a, number_t b) { return a < b ? MAKE_NUMBER(1) : MAKE_NUMBER(0); });
+			break;
+		case Op::LE:
+			binary(at, h, [](number_t a, number_t b) { return a <= b ? MAKE_NUMBER(1) : MAKE_NUMBER(0); });
+			break;
+		case Op::GT:
+			binary(at, h, [](number_t a, number_t b) { return a > b ? MAKE_NUMBER(1) : MAKE_NUMBER(0); });
+			break;
+		case Op::GE:
+			binary(at, h, [](number_t a, number_t b) { return a >= b ? MAKE_NUMBER(1) : MAKE_NUMBER(0); });
+			break;
+		case Op::AND:
+			binary(at, h, [](number_t a, number_t b) { return a & b; });
+			break;
+		case Op::OR:
+			binary(at, h, [](number_t a, number_t b) { return a | b; });
+			break;
+		case Op::NEG: {
+			check(h - 1, at, "Operand of negation is not a number");
+			number_t *n = num(h - 1);
+			for (int l = 0; l < lanes; l++) {
+				n[l] = active[l] ? -n[l] : n[l];
+			}
+			cpu(4);
+			break;
+		}
+		case Op::SINE: {
+			check(h - 1, at, "Operand of sine is not a number");
+			number_t *n = num(h - 1);
+			for (int l = 0; l < lanes; l++) {
+				if (active[l]) n[l] = TurtleRunner::sin((n[l] & 0xffff) >> 2) << 2;
+			}
+			cpu(42);
+			break;
+		}
+		case Op::RAND: {
+			number_t *n = num(h);
+			ValueKind *k = kind(h);
+			for (int l = 0; l < lanes; l++) {
+				number_t next_seed = TurtleRunner::random_iteration(seed[l]);
+				seed[l] = active[l] ? next_seed : seed[l];
+				n[l] = active[l] ? (next_seed >> 16) & 0xFFFF : n[l];
+				k[l] = active[l] ? ValueKind::NUMBER : k[l];
+			}
+			cpu(12 + 144);
+			break;
+		}
+
+		// Control flow
+		case Op::COND: {
+			check(h - 1, at, "Condition is not a number");
+			number_t *n = num(h - 1);
+			for (int l = 0; l < lanes; l++) {
+				bool jump = active[l] && n[l] == 0;
+				cycles[l] += active[l] ? (jump ? 10 : 12 + 10) : 0;
+				pc[l] = jump ? ins.a : pc[l];
+			}
+			break;
+		}
+		case Op::WHEN: {
+			check(h - 1, at, "Condition is not a number");
+			number_t *n = num(h - 1);
+			for (int l = 0; l < lanes; l++) {
+				pc[l] = active[l] && n[l] == 0 ? ins.a : pc[l];
+			}
+			break;
+		}
+		case Op::WHEN_DONE:
+			cpu(12 + 10 + (ins.a != 0 ? 8 : 0));
+			count(at);
+			break;
+		case Op::ELSE_DONE:
+			cpu(10 + (ins.a != 0 ? 8 : 0));
+			count(at);
+			break;
+		case Op::JUMP:
+			for (int l = 0; l < lanes; l++) {
+				pc[l] = active[l] ? ins.a : pc[l];
+			}
+			break;
+		case Op::RETURN:
+		case Op::END:
+			for (int l = 0; l < lanes; l++) {
+				if (!active[l]) continue;
+				if (!forked[l]) {
+					if (frame[l] != nullptr) frame[l]->turtles_died++;
+					cpu(l, 40);
+				}
+				pc[l] = DONE;
+			}
+			break;
+
+		// Statements
+		case Op::FORK:
+			for (int l = 0; l < lanes; l++) {
+				if (!active[l]) continue;
+				State& s = *turtle[l];
+				store(l, s);
+				out->scheduled.emplace_back(ins.b, code.proc_entry[ins.b], s, gather(l, h - ins.a, h), ins.a);
+				scheduled_lane.push_back(l);
+				forked[l] = true;
+				if (ins.b == s.proc) {
+					// Assume tail fork. Negate dispatch overhead.
+					cpu(l, 12 + 16 + 20 + ins.a * 28 - 140);
+				} else {
+					cpu(l, 12 + 16 + 344 + ins.a * 34);
+					if (frame[l] != nullptr) frame[l]->per_wire_cycles += 20;
+				}
+			}
+			break;
+		case Op::WAIT: {
+			check(h - 1, at, "Wait value is not a number");
+			number_t *n = num(h - 1);
+			RoseStatistics& stats = *runner.stats;
+			for (int l = 0; l < lanes; l++) {
+				if (!active[l]) continue;
+				number_t wait = n[l];
+				if (wait < 0) {
+					warn(l, at, "Negative wait");
+					continue;
+				}
+				State& s = *turtle[l];
+				int f = NUMBER_TO_INT(s.time);
+				int new_frame = NUMBER_TO_INT(s.time + wait);
+				bool next_frame = f < new_frame;
+				while (f < stats.frames && f < new_frame) {
+					stats.frame[f++].turtles_survived++;
+					forked[l] = false;
+				}
+				flush(l);
+				s.time += wait;
+				short new_f = NUMBER_TO_INT(s.time);
+				frame[l] = new_f >= 0 && new_f < stats.frames ? &stats.frame[new_f] : nullptr;
+				cpu(l, 146);
+				if (next_frame && frame[l] != nullptr) {
+					// Resume in the new frame
+					Value *locals = gather(l, 0, code.heights[at + 1]);
+					s.pc = at + 1;
+					s.stack.assign(locals, locals + code.heights[at + 1]);
+					store(l, s);
+					out->scheduled.push_back(std::move(s));
+					scheduled_lane.push_back(l);
+					pc[l] = DONE;
+				}
+			}
+			break;
+		}
+		case Op::TURN: {
+			check(h - 1, at, "Turn value is not a number");
+			number_t *n = num(h - 1);
+			for (int l = 0; l < lanes; l++) {
+				direction[l] += active[l] ? n[l] : 0;
+			}
+			cpu(12 + 16 + 20 + 16);
+			break;
+		}
+		case Op::FACE: {
+			check(h - 1, at, "Face value is not a number");
+			number_t *n = num(h - 1);
+			for (int l = 0; l < lanes; l++) {
+				direction[l] = active[l] ? n[l] : direction[l];
+			}
+			cpu(16);
+			break;
+		}
+		case Op::SIZE: {
+			check(h - 1, at, "Size is not a number");
+			number_t *n = num(h - 1);
+			for (int l = 0; l < lanes; l++) {
+				size[l] = active[l] ? n[l] : size[l];
+			}
+			cpu(16);
+			break;
+		}
+		case Op::TINT: {
+			check(h - 1, at, "Tint is not a number");
+			number_t *n = num(h - 1);
+			int tint_count = runner.stats->layer_count * runner.stats->layer_depth;
+			for (int l = 0; l < lanes; l++) {
+				if (!active[l]) continue;
+				turtle[l]->tint = n[l];
+				short tint_int = NUMBER_TO_INT(n[l]);
+				if (tint_int < 0) {
+					warn(l, at, "Negative tint");
+				} else if (tint_int >= tint_count) {
+					warn(l, at, "Tint value outside range");
+				}
+			}
+			cpu(16);
+			break;
+		}
+		case Op::SEED: {
+			check(h - 1, at, "Seed is not a number");
+			number_t *n = num(h - 1);
+			for (int l = 0; l < lanes; l++) {
+				number_t new_seed = TurtleRunner::random_iteration(TurtleRunner::random_iteration(n[l]));
+				seed[l] = active[l] ? new_seed : seed[l];
+			}
+			cpu(204);
+			break;
+		}
+		case Op::MOVE: {
+			check(h - 1, at, "Move distance is not a number");
+			number_t *n = num(h - 1);
+			for (int l = 0; l < lanes; l++) {
+				if (!active[l]) continue;
+				number_t m = n[l];
+				int sa = TurtleRunner::sin(direction[l] >> 10);
+				int ca = TurtleRunner::sin((direction[l] >> 10) + 4096);
+				if (m < MAKE_NUMBER(32) && m > -MAKE_NUMBER(32)) {
+					// High precision move
+					x[l] += ((m << 10 >> 16) * ca) >> 8;
+					y[l] += ((m << 10 >> 16) * sa) >> 8;
+					cpu(l, 424);
+				} else {
+					// High distance move
+					x[l] += (m << 2 >> 16) * ca;
+					y[l] += (m << 2 >> 16) * sa;
+					cpu(l, m >= MAKE_NUMBER(32) ? 348 : 366);
+				}
+			}
+			break;
+		}
+		case Op::JUMP_XY: {
+			check(h - 2, at, "X is not a number");
+			check(h - 1, at, "Y is not a number");
+			number_t *nx = num(h - 2);
+			number_t *ny = num(h - 1);
+			for (int l = 0; l < lanes; l++) {
+				x[l] = active[l] ? nx[l] : x[l];
+				y[l] = active[l] ? ny[l] : y[l];
+			}
+			cpu(32);
+			break;
+		}
+		case Op::DRAW:
+		case Op::PLOT:
+			for (int l = 0; l < lanes; l++) {
+				if (!active[l]) continue;
+				short f = NUMBER_TO_INT(turtle[l]->time);
+				if (f >= 0 && f < runner.stats->frames) {
+					short px = NUMBER_TO_INT(x[l]);
+					short py = NUMBER_TO_INT(y[l]);
+					short psize = NUMBER_TO_INT(size[l]);
+					short tint = NUMBER_TO_INT(turtle[l]->tint);
+					out->plots.push_back({f, px, py, psize, ins.op == Op::DRAW ? tint : (short)~tint});
+					plot_lane.push_back(l);
+					runner.stats->draw(f, px, py, psize);
+				}
+			}
+			break;
+
+		default:
+			for (int l = 0; l < lanes; l++) {
+				if (active[l]) scalar(at, l);
+			}
+			break;
+		}
+	}
+
+	// Put the effects added by the batch in lane order, dropping those of
+	// lanes after a failing lane.
+	template <class T>
+	void arrange(std::vector<T>& items, std::vector<int>& item_lane) {
+		size_t base = items.size() - item_lane.size();
+		bool ordered = true;
+		for (size_t i = 0; i < item_lane.size(); i++) {
+			if (item_lane[i] > error_lane || (i > 0 && item_lane[i] < item_lane[i - 1])) {
+				ordered = false;
+				break;
+			}
+		}
+		if (!ordered) {
+			std::vector<size_t> index(item_lane.size());
+			std::iota(index.begin(), index.end(), 0);
+			std::stable_sort(index.begin(), index.end(), [&](size_t a, size_t b) {
+				return item_lane[a] < item_lane[b];
+			});
+			std::vector<T> arranged;
+			for (size_t i : index) {
+				if (item_lane[i] <= error_lane) arranged.push_back(std::move(items[base + i]));
+			}
+			items.resize(base);
+			for (T& item : arranged) {
+				items.push_back(std::move(item));
+			}
+		}
+		item_lane.clear();
+	}
+
+public:
+	TurtleBatch(TurtleRunner& runner, const ThreadedCode& code) : runner(runner), code(code) {}
+
+	TurtleBatch(const TurtleBatch&) = delete;
+	TurtleBatch& operator=(const TurtleBatch&) = delete;
+
+	// Run up to LANES turtles in their current frame and append their effects.
+	// If a turtle fails, the effects end with those of the failing turtle.
+	void run(State *turtles, int count, TurtleEffects& effects) {
+		numbers.resize(code.max_height * LANES);
+		kinds.resize(code.max_height * LANES);
+		gathered.resize(code.max_height);
+		out = &effects;
+		lanes = count;
+		error_lane = count;
+		for (int l = 0; l < lanes; l++) {
+			State& s = turtles[l];
+			turtle[l] = &s;
+			load(l, s);
+			pc[l] = s.pc;
+			forked[l] = false;
+			bool entry = s.pc == code.proc_entry[s.proc];
+			cycles[l] = entry ? 140 : 0;
+			runner.counts[s.pc] += entry;
+			short f = NUMBER_TO_INT(s.time);
+			frame[l] = f >= 0 && f < runner.stats->frames ? &runner.stats->frame[f] : nullptr;
+			const Value *locals = s.stack.data();
+			for (int slot = 0; slot < s.stack.size(); slot++) {
+				kind(slot)[l] = locals[slot].kind;
+				num(slot)[l] = locals[slot].number;
+			}
+		}
+
+		while (true) {
+			unsigned at = DONE;
+			for (int l = 0; l < lanes; l++) {
+				at = std::min(at, pc[l]);
+			}
+			if (at == DONE) break;
+			for (int l = 0; l < lanes; l++) {
+				active[l] = pc[l] == at;
+			}
+			step(at);
+		}
+
+		for (int l = 0; l < lanes; l++) {
+			flush(l);
+		}
+		arrange(effects.plots, plot_lane);
+		arrange(effects.scheduled, scheduled_lane);
+		arrange(effects.warnings, warning_lane);
+		if (error_lane < count) {
+			effects.failed = true;
+			effects.error = error;
+		}
+	}
+};
@@ -0,0 +1,891 @@
+#pragma once
+
+#include "ast.h"
+#include "symbol_linking.h"
+#include "threaded_code.h"
+#include "block_pool.h"
+#include "wire_conflicts.h"
+#include "trace.h"
+#include "jit.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Locals of a turtle that is not running, stored inline when there are few
+// and in a pooled block otherwise
+class Locals {
+	static const int INLINE_COUNT = 6;
+	int count = 0;
+	Value inline_values[INLINE_COUNT];
+	Value *heap_values = nullptr;
+
+	void release() {
+		if (heap_values) {
+			BlockPool::local().release(heap_values, count * sizeof(Value));
+			heap_values = nullptr;
+		}
+	}
+
+public:
+	Locals() {}
+	Locals(const Value *begin, const Value *end) {
+		assign(begin, end);
+	}
+	Locals(const Locals& other) {
+		assign(other.data(), other.data() + other.count);
+	}
+	Locals(Locals&& other) {
+		*this = std::move(other);
+	}
+
+	~Locals() {
+		release();
+	}
+
+	Locals& operator=(const Locals& other) {
+		if (this != &other) assign(other.data(), other.data() + other.count);
+		return *this;
+	}
+
+	Locals& operator=(Locals&& other) {
+		if (this != &other) {
+			release();
+			count = other.count;
+			if (count > INLINE_COUNT) {
+				heap_values = other.heap_values;
+				other.heap_values = nullptr;
+			} else {
+				std::copy(other.inline_values, other.inline_values + count, inline_values);
+			}
+			other.count = 0;
+		}
+		return *this;
+	}
+
+	void assign(const Value *begin, const Value *end) {
+		release();
+		count = end - begin;
+		if (count > INLINE_COUNT) {
+			heap_values = static_cast<Value *>(BlockPool::local().allocate(count * sizeof(Value)));
+		}
+		std::copy(begin, end, data());
+	}
+
+	Value *data() {
+		return count > INLINE_COUNT ? heap_values : inline_values;
+	}
+
+	const Value *data() const {
+		return count > INLINE_COUNT ? heap_values : inline_values;
+	}
+
+	int size() const {
+		return count;
+	}
+};
+
+// Wire values of a turtle. Shared with forked turtles until written. The
+// wires that have been written are linked in order of their last write, so
+// a write takes constant time and a read can list the wires written since.
+struct WireData {
+	struct Entry {
+		Value value;
+		bool set = false;
+		int newer = -1;
+		int older = -1;
+	};
+
+	std::vector<Entry, PoolAllocator<Entry>> entries;
+	int latest = -1;
+
+	WireData(int wire_count) : entries(wire_count) {}
+
+	bool isSet(int i) const {
+		return entries[i].set;
+	}
+
+	Value value(int i) const {
+		return entries[i].value;
+	}
+
+	void write(int i, Value value) {
+		Entry& entry = entries[i];
+		entry.value = value;
+		if (latest == i) return;
+		if (entry.set) {
+			entries[entry.newer].older = entry.older;
+			if (entry.older >= 0) entries[entry.older].newer = entry.newer;
+		}
+		entry.set = true;
+		entry.newer = -1;
+		entry.older = latest;
+		if (latest >= 0) entries[latest].newer = i;
+		latest = i;
+	}
+
+	// Call f for each wire written since wire i was last written
+	template <typename F>
+	void forWrittenSince(int i, F f) const {
+		for (int j = latest; j != i; j = entries[j].older) {
+			f(j);
+		}
+	}
+
+	static std::shared_ptr<WireData> make(int wire_count) {
+		return std::allocate_shared<WireData>(PoolAllocator<WireData>(), wire_count);
+	}
+
+	static std::shared_ptr<WireData> copy(const WireData& other) {
+		return std::allocate_shared<WireData>(PoolAllocator<WireData>(), other);
+	}
+};
+
+struct State {
+	int proc;
+	int pc;
+	number_t time;
+	number_t x,y;
+	number_t size;
+	number_t direction;
+	number_t tint;
+	number_t seed;
+	Locals stack;
+	std::shared_ptr<WireData> wires;
+	// Number of identical turtles this turtle stands for
+	int weight = 1;
+	// Turtle number in traces, 0 until assigned
+	uint32_t id = 0;
+
+	State() {}
+	State(int proc, int pc, const State& parent, const Value *args, int n_args)
+	: proc(proc), pc(pc), stack(args, args + n_args), wires(parent.wires), weight(parent.weight) {
+		time = parent.time;
+		x = parent.x;
+		y = parent.y;
+		size = parent.size;
+		direction = parent.direction;
+		tint = parent.tint;
+		seed = parent.seed;
+	}
+
+	State(const State& state) = default;
+	State(State&& state) = default;
+	State& operator=(const State& state) = default;
+	State& operator=(State&& state) = default;
+
+	// Whether the turtles will behave identically from here on
+	bool sameAs(const State& other) const {
+		if (proc != other.proc || pc != other.pc || time != other.time ||
+			x != other.x || y != other.y || size != other.size ||
+			direction != other.direction || tint != other.tint || seed != other.seed ||
+			wires != other.wires ||
+			stack.size() != other.stack.size()) {
+			return false;
+		}
+		const Value *a = stack.data();
+		const Value *b = other.stack.data();
+		for (int i = 0; i < stack.size(); i++) {
+			if (a[i].kind != b[i].kind || a[i].number != b[i].number) return false;
+		}
+		return true;
+	}
+
+	uint64_t hash() const {
+		uint64_t h = 14695981039346656037ULL;
+		auto mix = [&](uint64_t value) {
+			h = (h ^ value) * 1099511628211ULL;
+		};
+		mix(proc);
+		mix(pc);
+		mix((uint32_t)x);
+		mix((uint32_t)y);
+		mix((uint32_t)size);
+		mix((uint32_t)direction);
+		mix((uint32_t)tint);
+		mix((uint32_t)seed);
+		mix((uintptr_t)wires.get());
+		for (int i = 0; i < stack.size(); i++) {
+			mix((uint32_t)stack.data()[i].number);
+		}
+		return h;
+	}
+};
+
+// Turtles waiting for a frame
+typedef std::vector<State, PoolAllocator<State>> StateList;
+
+// Error in running code. Turtles may run on other threads, which must not
+// touch the AST, so errors refer to the instruction rather than the token.
+struct TurtleError {
+	int pc;
+	std::string message;
+
+	TurtleError() {}
+	TurtleError(int pc, std::string message) : pc(pc), message(std::move(message)) {}
+};
+
+// Effects of running a batch of turtles, to be applied in turtle order
+struct TurtleEffects {
+	std::vector<Plot> plots;
+	std::vector<State> scheduled;
+	std::vector<std::pair<int, number_t>> literals;
+	std::vector<std::pair<int, const char *>> warnings;
+	// Trace records. Forks refer to the new turtle by its index in scheduled.
+	std::vector<TraceRecord> trace;
+	bool failed = false;
+	TurtleError error;
+
+	void clear() {
+		plots.clear();
+		scheduled.clear();
+		literals.clear();
+		warnings.clear();
+		trace.clear();
+		failed = false;
+	}
+};
+
+// Execution of compiled code for one thread
+class TurtleRunner {
+	friend class TurtleBatch;
+
+	const ThreadedCode& code;
+	const SymbolLinking& sym;
+	std::unique_ptr<RoseStatistics> stats;
+	// Statistics of a weighted turtle, before they are multiplied
+	std::unique_ptr<RoseStatistics> weighted_stats;
+	FrameStatistics *frame_stats;
+	State state;
+	std::vector<Value> stack_buffer;
+	std::vector<char> literal_seen;
+	bool forked_in_frame;
+	bool suspended;
+	bool tracing = false;
+
+	// Native code
+	std::unique_ptr<NativeCode> native;
+	TurtleError native_error;
+
+public:
+	TurtleEffects *effects;
+	WireConflicts wire_conflicts;
+	// Times each procedure entry and end of a when or else branch was
+	// reached, with the weight of the turtles
+	std::vector<int64_t> counts;
+
+	TurtleRunner(const ThreadedCode& code, const SymbolLinking& sym)
+		: code(code), sym(sym), frame_stats(nullptr), effects(nullptr), wire_conflicts(sym.wire_count) {}
+
+	TurtleRunner(const TurtleRunner&) = delete;
+	TurtleRunner& operator=(const TurtleRunner&) = delete;
+
+	// Prepare for running procedures
+	void start(const RoseStatistics& shape, bool use_jit, bool trace = false) {
+		tracing = trace;
+		stats.reset(new RoseStatistics(shape.frames, shape.width, shape.height, shape.layer_count, shape.layer_depth));
+		weighted_stats.reset(new RoseStatistics(shape.frames, shape.width, shape.height, shape.layer_count, shape.layer_depth));
+		reserve();
+		if (use_jit && NativeCode::supported()) {
+			NativeRuntime runtime = {
+				this, native_step, native_literal, literal_seen.data(), &frame_stats, counts.data(),
+				(char *)&state, offsetof_state(state.x), offsetof_state(state.y),
+				offsetof_state(state.size), offsetof_state(state.direction), offsetof_state(state.weight)
+			};
+			native.reset(new NativeCode(code, runtime));
+			if (!native->valid()) native.reset();
+		}
+	}
+
+	bool jit_active() {
+		return native != nullptr;
+	}
+
+	const RoseStatistics& statistics() {
+		return *stats;
+	}
+
+	// Mark a literal as already registered
+	void seeLiteral(int slot) {
+		literal_seen[slot] = true;
+	}
+
+	// Util
+	static int sin(int a) {
+		int na = a & 8191;
+		if (na == 4096) {
+			return a & 8192 ? -16384 : 16384;
+		}
+		if (na > 4096) {
+			na = 8192 - na;
+		}
+		int na2 = (na * na) >> 8;
+		int r = (((((((2373 * na2) >> 16) - 21073) * na2) >> 16) + 51469) * na) >> 13;
+		return a & 8192 ? -r : r;
+	}
+
+	static number_t random_iteration(number_t v) {
+		return ((v & 0xFFFF) * 0x9D3D) + ((v << 16) | ((v >> 16) & 0xFFFF));
+	}
+
+	// Run a turtle in its current frame until it dies or waits for a later frame
+	void runTurtle(State&& turtle) {
+		if (turtle.weight > 1) {
+			runWeighted(std::move(turtle));
+		} else {
+			runState(std::move(turtle));
+		}
+	}
+
+	// Evaluate an expression outside of procedures
+	Value evaluate(int entry) {
+		reserve();
+		frame_stats = nullptr;
+		Value *sp = run(entry, stack_buffer.data(), true);
+		return sp[-1];
+	}
+
+private:
+	void runState(State&& turtle) {
+		state = std::move(turtle);
+		update_frame();
+		if (state.pc == code.proc_entry[state.proc]) {
+			cpu(140);
+			count(state.pc);
+		}
+		forked_in_frame = false;
+		suspended = false;
+		std::copy(state.stack.data(), state.stack.data() + state.stack.size(), stack_buffer.begin());
+		if (native) {
+			if (native->run(state.pc, stack_buffer.data()) == 1) {
+				throw native_error;
+			}
+		} else {
+			run(state.pc, stack_buffer.data() + state.stack.size(), code.checked);
+		}
+		if (suspended) {
+			effects->scheduled.push_back(std::move(state));
+		} else if (!forked_in_frame) {
+			if (frame_stats) frame_stats->turtles_died++;
+			cpu(40);
+		}
+	}
+
+	// Run a turtle standing for several identical turtles. Its statistics
+	// are counted separately and added as many times as it has weight.
+	void runWeighted(State&& turtle) {
+		int weight = turtle.weight;
+		int first = std::max<int>(NUMBER_TO_INT(turtle.time), 0);
+		std::swap(stats, weighted_stats);
+		try {
+			runState(std::move(turtle));
+		} catch (...) {
+			std::swap(stats, weighted_stats);
+			throw;
+		}
+		std::swap(stats, weighted_stats);
+		int last = std::min<int>(NUMBER_TO_INT(state.time), stats->frames - 1);
+		for (int f = first; f <= last; f++) {
+			stats->frame[f].add(weighted_stats->frame[f], weight);
+			weighted_stats->frame[f] = FrameStatistics();
+		}
+	}
+
+	void reserve() {
+		literal_seen.resize(code.literal_nodes.size());
+		counts.resize(code.code.size());
+		stack_buffer.resize(std::max<size_t>(stack_buffer.size(), code.max_height));
+	}
+
+	// Count CPU cycles
+	void cpu(int cycles, int per_wire_cycles = 0) {
+		if (frame_stats != nullptr) {
+			frame_stats->cpu_compute_cycles += cycles;
+			frame_stats->per_wire_cycles += per_wire_cycles;
+		}
+	}
+
+	void count(int pc) {
+		counts[pc] += state.weight;
+	}
+
+	void update_frame() {
+		short f = NUMBER_TO_INT(state.time);
+		frame_stats = f >= 0 && f < stats->frames ? &stats->frame[f] : nullptr;
+	}
+
+	void warn(int pc, const char *message) {
+		effects->warnings.emplace_back(pc, message);
+	}
+
+	void literal(int slot, number_t value) {
+		literal_seen[slot] = true;
+		effects->literals.emplace_back(slot, value);
+	}
+
+	template <class T>
+	int offsetof_state(T& field) {
+		return (char *)&field - (char *)&state;
+	}
+
+	// Entry points for native code
+	static int native_step(void *context, Value *sp, int pc) {
+		TurtleRunner *runner = (TurtleRunner *)context;
+		try {
+			runner->step(pc, sp);
+			return runner->suspended ? 2 : 0;
+		} catch (const TurtleError& error) {
+			runner->native_error = error;
+			return 1;
+		}
+	}
+
+	static void native_literal(void *context, int slot, number_t value) {
+		((TurtleRunner *)context)->literal(slot, value);
+	}
+
+	template <bool CHECKED>
+	number_t pop_number(int pc, Value *&sp, const char *message) {
+		Value value = *--sp;
+		if (CHECKED && value.kind != ValueKind::NUMBER) {
+			throw TurtleError(pc, message);
+		}
+		return value.number;
+	}
+
+	template <bool CHECKED, class F>
+	void binary(int pc, Value *&sp, F eval) {
+		cpu(20);
+		Value right = *--sp;
+		Value& left = sp[-1];
+		if (CHECKED && left.kind != ValueKind::NUMBER) {
+			throw TurtleError(pc, "Left side of operation is not a number");
+		}
+		if (CHECKED && right.kind != ValueKind::NUMBER) {
+			throw TurtleError(pc, "Right side of operation is not a number");
+		}
+		left.number = eval(left.number, right.number);
+	}
+
+	void fork(int proc, int n_args, Value *&sp) {
+		sp -= n_args;
+		effects->scheduled.emplace_back(proc, code.proc_entry[proc], state, sp, n_args);
+		forked_in_frame = true;
+		if (proc == state.proc) {
+			// Assume tail fork. Negate dispatch overhead.
+			cpu(20 + n_args * 28 - 140);
+		} else {
+			cpu(344 + n_args * 34, 20);
+		}
+	}
+
+	void draw(short tint) {
+		short f = NUMBER_TO_INT(state.time);
+		if (f >= 0 && f < stats->frames) {
+			short x = NUMBER_TO_INT(state.x);
+			short y = NUMBER_TO_INT(state.y);
+			short size = NUMBER_TO_INT(state.size);
+			effects->plots.push_back({f, x, y, size, tint});
+			stats->draw(f, x, y, size);
+		}
+	}
+
+	// Run compiled code until the end of the procedure or expression.
+	// Returns the final stack position.
+	Value *run(int pc, Value *sp, bool checked) {
+		if (tracing) {
+			return checked ? run<true, true>(pc, sp) : run<false, true>(pc, sp);
+		}
+		return checked ? run<true, false>(pc, sp) : run<false, false>(pc, sp);
+	}
+
+	template <bool CHECKED, bool TRACED>
+	Value *run(int pc, Value *sp) {
+		while (pc >= 0) {
+			pc = execute<CHECKED, TRACED>(pc, sp);
+		}
+		return sp;
+	}
+
+	// Execute one instruction of a procedure
+	int step(int pc, Value *&sp) {
+		if (tracing) {
+			return code.checked ? execute<true, true>(pc, sp) : execute<false, true>(pc, sp);
+		}
+		return code.checked ? execute<true, false>(pc, sp) : execute<false, false>(pc, sp);
+	}
+
+	void trace(TraceKind kind, int pc, int32_t a, int32_t b, uint8_t flags = 0) {
+		TraceRecord record;
+		record.kind = kind;
+		record.flags = flags;
+		record.proc = state.proc;
+		record.turtle = state.id;
+		record.frame = NUMBER_TO_INT(state.time);
+		record.line = code.lines[pc];
+		record.column = code.columns[pc];
+		record.x = NUMBER_TO_INT(state.x);
+		record.y = NUMBER_TO_INT(state.y);
+		record.a = a;
+		record.b = b;
+		effects->trace.push_back(record);
+	}
+
+	// Execute one instruction. Returns the next pc, or -1 at the end.
+	// Without CHECKED, values are assumed to be of the right kind. With
+	// TRACED, forks, waits, moves, draws and wire writes are traced.
+	template <bool CHECKED, bool TRACED>
+	int execute(int pc, Value *&sp) {
+		const Instruction& ins = code.code[pc];
+		switch (ins.op) {
+		// Values
+		case Op::CONST:
+			*sp++ = Value(ins.a);
+			cpu(12 + 16);
+			break;
+		case Op::LITERAL:
+			if (!literal_seen[ins.b]) {
+				literal(ins.b, ins.a);
+			}
+			*sp++ = Value(ins.a);
+			cpu(12 + 16);
+			break;
+		case Op::FACT:
+			if (ins.a >= sym.fact_values.size()) {
+				throw TurtleError(pc, "Facts can only refer to earlier facts");
+			}
+			*sp++ = Value(sym.fact_values[ins.a]);
+			cpu(12 + 16);
+			break;
+		case Op::LOCAL: {
+			Value local = sp[ins.a - code.heights[pc]];
+			*sp++ = local;
+			cpu(12 + 16);
+			break;
+		}
+		case Op::X:
+			*sp++ = Value(state.x);
+			cpu(12 + 16);
+			break;
+		case Op::Y:
+			*sp++ = Value(state.y);
+			cpu(12 + 16);
+			break;
+		case Op::DIR:
+			*sp++ = Value(state.direction);
+			cpu(12 + 16);
+			break;
+		case Op::WIRE: {
+			const WireData& wires = *state.wires;
+			if (!wires.isSet(ins.a)) {
+				throw TurtleError(pc, "Uninitialized wire");
+			}
+			*sp++ = wires.value(ins.a);
+			wires.forWrittenSince(ins.a, [&](int wire) {
+				wire_conflicts.add(ins.a, wire);
+			});
+			cpu(12 + 16);
+			break;
+		}
+		case Op::PROC:
+			*sp++ = Value(ins.a, true);
+			cpu(12 + 16);
+			break;
+
+		// Operators
+		case Op::ADD:
+			binary<CHECKED>(pc, sp, [](number_t a, number_t b) { return a + b; });
+			break;
+		case Op::SUB:
+			binary<CHECKED>(pc, sp, [](number_t a, number_t b) { return a - b; });
+			break;
+		case Op::MUL:
+			cpu(126 - 20);
+			binary<CHECKED>(pc, sp, [&](number_t a, number_t b) {
+				if (a >= (128 << 16) || a < -(128 << 16)) {
+					warn(pc, "Left operand overflows");
+				}
+				if (b >= (128 << 16) || b < -(128 << 16)) {
+					warn(pc, "Right operand overflows");
+				}
+				return (a << 8 >> 16) * (b << 8 >> 16);
+			});
+			break;
+		case Op::DIV:
+			cpu(218 - 20);
+			binary<CHECKED>(pc, sp, [&](number_t a, number_t b) {
+				if (b >= (128 << 16) || b < -(128 << 16)) {
+					warn(pc, "Right operand overflows");
+				}
+				int divisor = b << 8 >> 16;
+				if (divisor == 0) {
+					throw TurtleError(pc, "Division by zero");
+				}
+				int div_result = a / divisor;
+				if (b >= (128 << 16) || b < -(128 << 16)) {
+					warn(pc, "Result overflows");
+				}
+				return div_result << 8;
+			});
+			break;
+		case Op::ASL:
+			binary<CHECKED>(pc, sp, [&](number_t a, number_t b) {
+				int shift = (b >> 16) & 63;
+				cpu(shift * 2);
+				if (shift >= 32) return 0;
+				return a << shift;
+			});
+			break;
+		case Op::ASR:
+			binary<CHECKED>(pc, sp, [&](number_t a, number_t b) {
+				int shift = (b >> 16) & 63;
+				cpu(shift * 2);
+				if (shift >= 32) return -1;
+				return a >> shift;
+			});
+			break;
+		case Op::LSR:
+			binary<CHECKED>(pc, sp, [&](number_t a, number_t b) {
+				int shift = (b >> 16) & 63;
+				cpu(shift * 2);
+				if (shift >= 32) return 0;
+				return (number_t)((unsigned)a >> shift);
+			});
+			break;
+		case Op::ROL:
+			binary<CHECKED>(pc, sp, [&](number_t a, number_t b) {
+				int shift = (b >> 16) & 31;
+				cpu(shift * 2);
+				if (shift == 0) return a;
+				return (number_t)((a << shift) | ((unsigned)a >> (32 - shift)));
+			});
+			break;
+		case Op::ROR:
+			binary<CHECKED>(pc, sp, [&](number_t a, number_t b) {
+				int shift = (b >> 16) & 31;
+				cpu(shift * 2);
+				if (shift == 0) return a;
+				return (number_t)(((unsigned)a >> shift) | (a << (32 - shift)));
+			});
+			break;
+		case Op::EQ:
+			binary<CHECKED>(pc, sp, [](number_t a, number_t b) { return a == b ? MAKE_NUMBER(1) : MAKE_NUMBER(0); });
+			break;
+		case Op::NE:
+			binary<CHECKED>(pc, sp, [](number_t a, number_t b) { return a != b ? MAKE_NUMBER(1) : MAKE_NUMBER(0); });
+			break;
+		case Op::LT:
+			binary<CHECKED>(pc, sp, [](number_t a, number_t b) { return a < b ? MAKE_NUMBER(1) : MAKE_NUMBER(0); });
+			break;
+		case Op::LE:
+			binary<CHECKED>(pc, sp, [](number_t a, number_t b) { return a <= b ? MAKE_NUMBER(1) : MAKE_NUMBER(0); });
+			break;
+		case Op::GT:
+			binary<CHECKED>(pc, sp, [](number_t a, number_t b) { return a > b ? MAKE_NUMBER(1) : MAKE_NUMBER(0); });
+			break;
+		case Op::GE:
+			binary<CHECKED>(pc, sp, [](number_t a, number_t b) { return a >= b ? MAKE_NUMBER(1) : MAKE_NUMBER(0); });
+			break;
+		case Op::AND:
+			binary<CHECKED>(pc, sp, [](number_t a, number_t b) { return a & b; });
+			break;
+		case Op::OR:
+			binary<CHECKED>(pc, sp, [](number_t a, number_t b) { return a | b; });
+			break;
+		case Op::NEG: {
+			number_t inner = pop_number<CHECKED>(pc, sp, "Operand of negation is not a number");
+			*sp++ = Value(-inner);
+			cpu(4);
+			break;
+		}
+		case Op::SINE: {
+			number_t inner = pop_number<CHECKED>(pc, sp, "Operand of sine is not a number");
+			*sp++ = Value(sin((inner & 0xffff) >> 2) << 2);
+			cpu(42);
+			break;
+		}
+		case Op::RAND:
+			state.seed = random_iteration(state.seed);
+			*sp++ = Value((state.seed >> 16) & 0xFFFF);
+			cpu(12 + 144);
+			break;
+
+		// Control flow
+		case Op::COND:
+			if (pop_number<CHECKED>(pc, sp, "Condition is not a number") != 0) {
+				cpu(12 + 10);
+			} else {
+				cpu(10);
+				return ins.a;
+			}
+			break;
+		case Op::WHEN:
+			if (pop_number<CHECKED>(pc, sp, "Condition is not a number") == 0) {
+				return ins.a;
+			}
+			break;
+		case Op::WHEN_DONE:
+			sp -= ins.a;
+			cpu(12 + 10);
+			if (ins.a != 0) cpu(8);
+			count(pc);
+			break;
+		case Op::ELSE_DONE:
+			sp -= ins.a;
+			cpu(10);
+			if (ins.a != 0) cpu(8);
+			count(pc);
+			break;
+		case Op::JUMP:
+			return ins.a;
+		case Op::RETURN:
+		case Op::END:
+			return -1;
+
+		// Statements
+		case Op::FORK:
+			cpu(12 + 16);
+			fork(ins.b, ins.a, sp);
+			if (TRACED) trace(TraceKind::FORK, pc, effects->scheduled.size() - 1, ins.b);
+			break;
+		case Op::FORK_CHECK: {
+			Value proc = sp[-1];
+			if (CHECKED && proc.kind != ValueKind::PROCEDURE) {
+				throw TurtleError(pc, "Target is not a procedure");
+			}
+			int n_params = code.proc_params[proc.proc];
+			if (ins.a != n_params) {
+				throw TurtleError(pc, "Wrong number of arguments for procedure " + code.proc_names[proc.proc] + ": "
+					+ std::to_string(ins.a) + " given, " + std::to_string(n_params) + " expected");
+			}
+			break;
+		}
+		case Op::FORK_DYNAMIC: {
+			int proc = sp[-ins.a - 1].proc;
+			fork(proc, ins.a, sp);
+			sp--;
+			if (TRACED) trace(TraceKind::FORK, pc, effects->scheduled.size() - 1, proc);
+			break;
+		}
+		case Op::WIRE_WRITE: {
+			if (state.wires.use_count() > 1) {
+				state.wires = WireData::copy(*state.wires);
+			} else {
+				// Turtles sharing the data may have run on other threads.
+				// The count is read relaxed, so order their reads before
+				// writing in place.
+				std::atomic_thread_fence(std::memory_order_acquire);
+			}
+			Value value = *--sp;
+			state.wires->write(ins.a, value);
+			if (TRACED) {
+				bool is_proc = value.kind == ValueKind::PROCEDURE;
+				trace(TraceKind::WIRE, pc, ins.a, is_proc ? value.proc : value.number, is_proc);
+			}
+			break;
+		}
+		case Op::WAIT: {
+			number_t wait = pop_number<CHECKED>(pc, sp, "Wait value is not a number");
+			if (TRACED) trace(TraceKind::WAIT, pc, wait, 0);
+			if (wait < 0) {
+				warn(pc, "Negative wait");
+				break;
+			}
+			int frame = NUMBER_TO_INT(state.time);
+			int new_frame = NUMBER_TO_INT(state.time + wait);
+			bool next_frame = frame < new_frame;
+			while (frame < stats->frames && frame < new_frame) {
+				stats->frame[frame++].turtles_survived++;
+				forked_in_frame = false;
+			}
+			state.time += wait;
+			update_frame();
+			cpu(146);
+			if (next_frame && frame_stats != nullptr) {
+				// Resume in the new frame. Past the end, keep running
+				// for the side effects on constants and wires.
+				state.pc = pc + 1;
+				state.stack.assign(sp - code.heights[pc + 1], sp);
+				suspended = true;
+				return -1;
+			}
+			break;
+		}
+		case Op::TURN:
+			state.direction += pop_number<CHECKED>(pc, sp, "Turn value is not a number");
+			cpu(12 + 16 + 20 + 16);
+			break;
+		case Op::FACE:
+			state.direction = pop_number<CHECKED>(pc, sp, "Face value is not a number");
+			cpu(16);
+			break;
+		case Op::SIZE:
+			state.size = pop_number<CHECKED>(pc, sp, "Size is not a number");
+			cpu(16);
+			break;
+		case Op::TINT: {
+			state.tint = pop_number<CHECKED>(pc, sp, "Tint is not a number");
+			cpu(16);
+			short tint_int = NUMBER_TO_INT(state.tint);
+			if (tint_int < 0) {
+				warn(pc, "Negative tint");
+			} else if (tint_int >= stats->layer_count * stats->layer_depth) {
+				warn(pc, "Tint value outside range");
+			}
+			break;
+		}
+		case Op::SEED:
+			state.seed = random_iteration(random_iteration(pop_number<CHECKED>(pc, sp, "Seed is not a number")));
+			cpu(204);
+			break;
+		case Op::MOVE: {
+			number_t m = pop_number<CHECKED>(pc, sp, "Move distance is not a number");
+			int sa = sin(state.direction >> 10);
+			int ca = sin((state.direction >> 10) + 4096);
+			if (m < MAKE_NUMBER(32) && m > -MAKE_NUMBER(32)) {
+				// High precision move
+				state.x += ((m << 10 >> 16) * ca) >> 8;
+				state.y += ((m << 10 >> 16) * sa) >> 8;
+				cpu(424);
+			} else {
+				// High distance move
+				state.x += (m << 2 >> 16) * ca;
+				state.y += (m << 2 >> 16) * sa;
+				cpu(m >= MAKE_NUMBER(32) ? 348 : 366);
+			}
+			if (TRACED) trace(TraceKind::MOVE, pc, state.x, state.y);
+			break;
+		}
+		case Op::JUMP_XY: {
+			Value y = *--sp;
+			Value x = *--sp;
+			if (CHECKED && x.kind != ValueKind::NUMBER) {
+				throw TurtleError(pc, "X is not a number");
+			}
+			if (CHECKED && y.kind != ValueKind::NUMBER) {
+				throw TurtleError(pc, "Y is not a number");
+			}
+			state.x = x.number;
+			state.y = y.number;
+			cpu(32);
+			if (TRACED) trace(TraceKind::MOVE, pc, state.x, state.y);
+			break;
+		}
+		case Op::DRAW:
+			draw(NUMBER_TO_INT(state.tint));
+			if (TRACED) trace(TraceKind::DRAW, pc, NUMBER_TO_INT(state.size), NUMBER_TO_INT(state.tint));
+			break;
+		case Op::PLOT:
+			draw(~NUMBER_TO_INT(state.tint));
+			if (TRACED) trace(TraceKind::DRAW, pc, NUMBER_TO_INT(state.size), ~NUMBER_TO_INT(state.tint));
+			break;
+		case Op::ERROR:
+			throw TurtleError(pc, code.messages[ins.a]);
+		}
+		return pc + 1;
+	}
+
+};
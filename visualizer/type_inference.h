@@ -0,0 +1,272 @@
+#pragma once
+
+#include "ast.h"
+#include "threaded_code.h"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Static types of the values in the lowered procedures. The type of a value
+// is whether it can be a number and which procedures it can be. Types flow
+// from fork arguments into procedure parameters and from wire writes into
+// wire reads until nothing changes.
+//
+// An operation that can only ever see the wrong kind of value is reported
+// as a compile error. When no operation can see the wrong kind of value,
+// the procedures run without checking the kind of values.
+class TypeInference {
+	struct Type {
+		bool number = false;
+		std::vector<uint64_t> procs;
+
+		Type(int words) : procs(words) {}
+
+		bool isProcedure() const {
+			for (uint64_t word : procs) {
+				if (word) return true;
+			}
+			return false;
+		}
+
+		bool join(const Type& other) {
+			bool changed = other.number && !number;
+			number |= other.number;
+			for (size_t w = 0; w < procs.size(); w++) {
+				changed |= (other.procs[w] & ~procs[w]) != 0;
+				procs[w] |= other.procs[w];
+			}
+			return changed;
+		}
+	};
+
+	typedef std::vector<Type> Stack;
+
+	const ThreadedCode& code;
+	int words;
+	std::vector<Stack> params;
+	std::vector<Type> wires;
+	bool changed = false;
+	bool report = false;
+	bool checks_needed = false;
+
+public:
+	TypeInference(const ThreadedCode& code, int wire_count)
+		: code(code), words((code.proc_entry.size() + 63) / 64), wires(wire_count, Type(words))
+	{
+		for (int n_params : code.proc_params) {
+			params.emplace_back(n_params, Type(words));
+		}
+	}
+
+	// Infer the types and report errors. Returns whether the procedures
+	// need checks of the kind of values when they run.
+	bool run() {
+		do {
+			changed = false;
+			for (int p = 0; p < code.proc_entry.size(); p++) {
+				scan(p);
+			}
+		} while (changed);
+		report = true;
+		for (int p = 0; p < code.proc_entry.size(); p++) {
+			scan(p);
+		}
+		return checks_needed;
+	}
+
+private:
+	Type number() {
+		Type type(words);
+		type.number = true;
+		return type;
+	}
+
+	Type procedure(int proc) {
+		Type type(words);
+		type.procs[proc / 64] |= (uint64_t)1 << (proc % 64);
+		return type;
+	}
+
+	void flow(Type& to, const Type& from) {
+		changed |= to.join(from);
+	}
+
+	void need_number(const Type& type, int pc, const char *message) {
+		if (!report || !type.isProcedure()) return;
+		if (!type.number) {
+			throw CompileException(code.tokens[pc], message);
+		}
+		checks_needed = true;
+	}
+
+	void fork_args(int proc, const Stack& stack, int n_args) {
+		for (int i = 0; i < n_args; i++) {
+			flow(params[proc][i], stack[stack.size() - n_args + i]);
+		}
+	}
+
+	// Compiled code only jumps forward, so the stack types at a jump target
+	// are complete when the scan reaches it.
+	void scan(int p) {
+		Stack stack = params[p];
+		std::unordered_map<int, Stack> merges;
+		auto stash = [&](int target) {
+			auto merge = merges.find(target);
+			if (merge == merges.end()) {
+				merges.emplace(target, stack);
+			} else {
+				for (size_t i = 0; i < stack.size(); i++) {
+					merge->second[i].join(stack[i]);
+				}
+			}
+		};
+
+		bool reachable = true;
+		for (int pc = code.proc_entry[p]; code.code[pc].op != Op::END; pc++) {
+			auto merge = merges.find(pc);
+			if (merge != merges.end()) {
+				if (reachable) {
+					for (size_t i = 0; i < stack.size(); i++) {
+						stack[i].join(merge->second[i]);
+					}
+				} else {
+					stack = std::move(merge->second);
+					reachable = true;
+				}
+				merges.erase(merge);
+			}
+			if (!reachable) continue;
+
+			const Instruction& ins = code.code[pc];
+			int h = stack.size();
+			switch (ins.op) {
+			// Values
+			case Op::CONST:
+			case Op::LITERAL:
+			case Op::FACT:
+			case Op::X:
+			case Op::Y:
+			case Op::DIR:
+			case Op::RAND:
+				stack.push_back(number());
+				break;
+			case Op::LOCAL:
+				stack.push_back(stack[ins.a]);
+				break;
+			case Op::WIRE:
+				stack.push_back(wires[ins.a]);
+				break;
+			case Op::PROC:
+				stack.push_back(procedure(ins.a));
+				break;
+
+			// Operators
+			case Op::ADD: case Op::SUB: case Op::MUL: case Op::DIV:
+			case Op::ASL: case Op::ASR: case Op::LSR: case Op::ROL: case Op::ROR:
+			case Op::EQ: case Op::NE: case Op::LT: case Op::LE: case Op::GT: case Op::GE:
+			case Op::AND: case Op::OR:
+				need_number(stack[h - 2], pc, "Left side of operation is not a number");
+				need_number(stack[h - 1], pc, "Right side of operation is not a number");
+				stack.pop_back();
+				stack.back() = number();
+				break;
+			case Op::NEG:
+				need_number(stack.back(), pc, "Operand of negation is not a number");
+				stack.back() = number();
+				break;
+			case Op::SINE:
+				need_number(stack.back(), pc, "Operand of sine is not a number");
+				stack.back() = number();
+				break;
+
+			// Control flow
+			case Op::COND:
+			case Op::WHEN:
+				need_number(stack.back(), pc, "Condition is not a number");
+				stack.pop_back();
+				stash(ins.a);
+				break;
+			case Op::WHEN_DONE:
+			case Op::ELSE_DONE:
+				stack.resize(h - ins.a, Type(words));
+				break;
+			case Op::JUMP:
+				stash(ins.a);
+				reachable = false;
+				break;
+			case Op::RETURN:
+			case Op::END:
+			case Op::ERROR:
+				reachable = false;
+				break;
+
+			// Statements
+			case Op::FORK:
+				fork_args(ins.b, stack, ins.a);
+				stack.resize(h - ins.a, Type(words));
+				break;
+			case Op::FORK_CHECK: {
+				const Type& target = stack.back();
+				if (report && target.number) {
+					if (!target.isProcedure()) {
+						throw CompileException(code.tokens[pc], "Target is not a procedure");
+					}
+					checks_needed = true;
+				}
+				break;
+			}
+			case Op::FORK_DYNAMIC: {
+				const Type& target = stack[h - ins.a - 1];
+				for (int q = 0; q < params.size(); q++) {
+					if ((target.procs[q / 64] >> (q % 64) & 1) && code.proc_params[q] == ins.a) {
+						fork_args(q, stack, ins.a);
+					}
+				}
+				stack.resize(h - ins.a - 1, Type(words));
+				break;
+			}
+			case Op::WIRE_WRITE:
+				flow(wires[ins.a], stack.back());
+				stack.pop_back();
+				break;
+			case Op::WAIT:
+				need_number(stack.back(), pc, "Wait value is not a number");
+				stack.pop_back();
+				break;
+			case Op::TURN:
+				need_number(stack.back(), pc, "Turn value is not a number");
+				stack.pop_back();
+				break;
+			case Op::FACE:
+				need_number(stack.back(), pc, "Face value is not a number");
+				stack.pop_back();
+				break;
+			case Op::SIZE:
+				need_number(stack.back(), pc, "Size is not a number");
+				stack.pop_back();
+				break;
+			case Op::TINT:
+				need_number(stack.back(), pc, "Tint is not a number");
+				stack.pop_back();
+				break;
+			case Op::SEED:
+				need_number(stack.back(), pc, "Seed is not a number");
+				stack.pop_back();
+				break;
+			case Op::MOVE:
+				need_number(stack.back(), pc, "Move distance is not a number");
+				stack.pop_back();
+				break;
+			case Op::JUMP_XY:
+				need_number(stack[h - 2], pc, "X is not a number");
+				need_number(stack[h - 1], pc, "Y is not a number");
+				stack.resize(h - 2, Type(words));
+				break;
+			case Op::DRAW:
+			case Op::PLOT:
+				break;
+			}
+		}
+	}
+};
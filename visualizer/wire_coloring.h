@@ -0,0 +1,202 @@
+#pragma once
+
+#include "wire_conflicts.h"
+
+#include <algorithm>
+#include <vector>
+
+// Work, counted in wires examined, spent searching for a better wire slot
+// assignment than the greedy one before settling for the best found so
+// far. A budget rather than a time limit gives the same assignment on any
+// machine.
+#define WIRE_SEARCH_BUDGET 100000000L
+
+// Assignment of wires to slots such that conflicting wires get different
+// slots. Every slot is copied on every fork, so the greedy smallest-last
+// coloring is improved by an exact DSATUR branch-and-bound search.
+class WireColoring {
+	int n;
+	std::vector<std::vector<int>> neighbors;
+
+	// Search state
+	std::vector<int> color;
+	// Number of neighbors of each wire in each slot
+	std::vector<std::vector<int>> slot_neighbors;
+	// Number of different slots among the neighbors of each wire
+	std::vector<int> saturation;
+	long budget;
+	bool stopped = false;
+
+	void greedy(const WireConflicts& conflicts) {
+		std::vector<int> conflict_count(n);
+		for (int i = 0; i < n; i++) {
+			conflicts.forEach(i, [&](int j) {
+				conflict_count[i]++;
+			});
+		}
+		std::vector<bool> stacked(n, false);
+		std::vector<int> assign_stack;
+		while (assign_stack.size() < n) {
+			int min_count = n;
+			for (int i = 0; i < n; i++) {
+				if (!stacked[i] && conflict_count[i] < min_count) min_count = conflict_count[i];
+			}
+
+			int first = assign_stack.size();
+			for (int i = 0; i < n; i++) {
+				if (!stacked[i] && conflict_count[i] == min_count) {
+					assign_stack.push_back(i);
+					stacked[i] = true;
+				}
+			}
+			for (int k = first; k < assign_stack.size(); k++) {
+				conflicts.forEach(assign_stack[k], [&](int j) {
+					conflict_count[j]--;
+				});
+			}
+		}
+
+		assignment.assign(n, -1);
+		while (assign_stack.size() > 0) {
+			int i = assign_stack.back();
+			assign_stack.pop_back();
+			std::vector<bool> used(slots, false);
+			conflicts.forEach(i, [&](int j) {
+				if (assignment[j] != -1) used[assignment[j]] = true;
+			});
+			assignment[i] = std::find(used.begin(), used.end(), false) - used.begin();
+			if (assignment[i] == slots) slots++;
+		}
+	}
+
+	// Largest clique found by growing one from each wire, most
+	// conflicting wires first
+	std::vector<int> findClique() {
+		std::vector<int> order(n);
+		for (int i = 0; i < n; i++) order[i] = i;
+		std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+			return neighbors[a].size() > neighbors[b].size();
+		});
+		std::vector<int> best;
+		std::vector<bool> adjacent(n);
+		for (int start : order) {
+			if (neighbors[start].size() < best.size()) break;
+			std::vector<int> clique = { start };
+			std::vector<int> candidates;
+			std::fill(adjacent.begin(), adjacent.end(), false);
+			for (int j : neighbors[start]) adjacent[j] = true;
+			for (int v : order) {
+				if (adjacent[v]) candidates.push_back(v);
+			}
+			while (!candidates.empty()) {
+				int v = candidates[0];
+				clique.push_back(v);
+				std::fill(adjacent.begin(), adjacent.end(), false);
+				for (int j : neighbors[v]) adjacent[j] = true;
+				candidates.erase(std::remove_if(candidates.begin(), candidates.end(), [&](int c) {
+					return !adjacent[c];
+				}), candidates.end());
+			}
+			if (clique.size() > best.size()) best = clique;
+		}
+		return best;
+	}
+
+	void setColor(int v, int c) {
+		color[v] = c;
+		for (int j : neighbors[v]) {
+			if (slot_neighbors[j][c]++ == 0) saturation[j]++;
+		}
+	}
+
+	void clearColor(int v) {
+		int c = color[v];
+		color[v] = -1;
+		for (int j : neighbors[v]) {
+			if (--slot_neighbors[j][c] == 0) saturation[j]--;
+		}
+	}
+
+	void search(int colored, int used) {
+		if (work > budget) stopped = true;
+		// Only assignments with fewer slots than the best one are of interest
+		if (stopped || used >= slots) return;
+		if (colored == n) {
+			slots = used;
+			assignment = color;
+			optimal = slots == lower_bound;
+			if (optimal) stopped = true;
+			return;
+		}
+
+		// Most constrained wire, breaking ties by most uncolored neighbors
+		int v = -1, v_saturation = -1, v_degree = -1;
+		for (int i = 0; i < n; i++) {
+			work++;
+			if (color[i] != -1 || saturation[i] < v_saturation) continue;
+			work += neighbors[i].size();
+			int degree = 0;
+			for (int j : neighbors[i]) {
+				if (color[j] == -1) degree++;
+			}
+			if (saturation[i] > v_saturation || degree > v_degree) {
+				v = i;
+				v_saturation = saturation[i];
+				v_degree = degree;
+			}
+		}
+
+		for (int c = 0; c < used; c++) {
+			if (slot_neighbors[v][c] == 0) {
+				setColor(v, c);
+				search(colored + 1, used);
+				clearColor(v);
+				if (stopped) return;
+			}
+		}
+		if (used + 1 < slots) {
+			setColor(v, used);
+			search(colored + 1, used + 1);
+			clearColor(v);
+		}
+	}
+
+public:
+	std::vector<int> assignment;
+	int slots = 0;
+	int greedy_slots = 0;
+	// No assignment can use fewer slots than this
+	int lower_bound = 0;
+	// The search completed, so no assignment uses fewer slots
+	bool optimal = false;
+	long work = 0;
+
+	WireColoring(const WireConflicts& conflicts, long budget = WIRE_SEARCH_BUDGET)
+		: n(conflicts.size()), neighbors(n), budget(budget)
+	{
+		greedy(conflicts);
+		greedy_slots = slots;
+
+		for (int i = 0; i < n; i++) {
+			conflicts.forEach(i, [&](int j) {
+				if (j != i) neighbors[i].push_back(j);
+			});
+		}
+		std::vector<int> clique = findClique();
+		lower_bound = clique.size();
+		optimal = slots == lower_bound;
+
+		if (!optimal) {
+			color.assign(n, -1);
+			slot_neighbors.assign(n, std::vector<int>(slots, 0));
+			saturation.assign(n, 0);
+			// The clique needs different slots in any assignment
+			for (int k = 0; k < clique.size(); k++) {
+				setColor(clique[k], k);
+			}
+			search(clique.size(), clique.size());
+			// Stopped only by the budget or by reaching the lower bound
+			if (!stopped) optimal = true;
+		}
+	}
+};
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Pairs of wires that hold values at the same time and can therefore not
+// share a wire slot. One row of bits per wire.
+class WireConflicts {
+	int n = 0;
+	int words = 0;
+	std::vector<uint64_t> bits;
+
+public:
+	WireConflicts() {}
+	WireConflicts(int wire_count)
+		: n(wire_count), words((wire_count + 63) / 64), bits(wire_count * words) {}
+
+	int size() const {
+		return n;
+	}
+
+	void add(int i, int j) {
+		bits[i * words + j / 64] |= (uint64_t)1 << (j % 64);
+	}
+
+	bool contains(int i, int j) const {
+		return (bits[i * words + j / 64] >> (j % 64)) & 1;
+	}
+
+	// Call f for each wire conflicting with wire i
+	template <typename F>
+	void forEach(int i, F f) const {
+		for (int w = 0; w < words; w++) {
+			uint64_t word = bits[i * words + w];
+			while (word) {
+				f(w * 64 + __builtin_ctzll(word));
+				word &= word - 1;
+			}
+		}
+	}
+
+	void merge(const WireConflicts& other) {
+		for (size_t k = 0; k < bits.size(); k++) {
+			bits[k] |= other.bits[k];
+		}
+	}
+
+	void makeSymmetric() {
+		for (int i = 0; i < n; i++) {
+			forEach(i, [&](int j) {
+				add(j, i);
+			});
+		}
+	}
+};